@@ -65,6 +65,27 @@ static inline void bfq_group_init_entity(struct bfqio_cgroup *bgrp,
 	entity->ioprio_class = entity->new_ioprio_class = bgrp->ioprio_class;
 	entity->ioprio_changed = 1;
 	entity->my_sched_data = &bfqg->sched_data;
+	bfqg->foreground = bgrp->foreground;
+}
+
+static inline int bfq_group_foreground(struct bfq_group *bfqg)
+{
+	return bfqg->foreground;
+}
+
+/*
+ * Account a completed sync request to the latency statistics of its group.
+ * Called under the queue lock.
+ */
+static inline void bfq_group_account_latency(struct bfq_group *bfqg,
+					     struct request *rq)
+{
+	unsigned long lat = jiffies - rq->start_time;
+
+	bfqg->lat_count++;
+	bfqg->lat_total += lat;
+	if (lat > bfqg->lat_max)
+		bfqg->lat_max = lat;
 }
 
 static inline void bfq_group_set_parent(struct bfq_group *bfqg,
@@ -548,6 +569,7 @@ static u64 bfqio_cgroup_##__VAR##_read(struct cgroup *cgroup,		\
 SHOW_FUNCTION(weight);
 SHOW_FUNCTION(ioprio);
 SHOW_FUNCTION(ioprio_class);
+SHOW_FUNCTION(foreground);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__VAR, __MIN, __MAX)				\
@@ -586,6 +608,76 @@ STORE_FUNCTION(ioprio, 0, IOPRIO_BE_NR - 1);
 STORE_FUNCTION(ioprio_class, IOPRIO_CLASS_RT, IOPRIO_CLASS_IDLE);
 #undef STORE_FUNCTION
 
+static int bfqio_cgroup_foreground_write(struct cgroup *cgroup,
+					 struct cftype *cftype, u64 val)
+{
+	struct bfqio_cgroup *bgrp;
+	struct bfq_group *bfqg;
+	struct hlist_node *n;
+
+	if (val > 1)
+		return -EINVAL;
+
+	if (!cgroup_lock_live_group(cgroup))
+		return -ENODEV;
+
+	bgrp = cgroup_to_bfqio(cgroup);
+
+	spin_lock_irq(&bgrp->lock);
+	bgrp->foreground = (unsigned short)val;
+	hlist_for_each_entry(bfqg, n, &bgrp->group_data, group_node)
+		bfqg->foreground = (int)val;
+	spin_unlock_irq(&bgrp->lock);
+
+	cgroup_unlock();
+
+	return 0;
+}
+
+/*
+ * One line per device the cgroup has done I/O on: device, number of sync
+ * requests completed, their average and maximum latency in milliseconds.
+ */
+static int bfqio_cgroup_latency_read(struct cgroup *cgroup,
+				     struct cftype *cftype, struct seq_file *m)
+{
+	struct bfqio_cgroup *bgrp;
+	struct bfq_group *bfqg;
+	struct bfq_data *bfqd;
+	struct hlist_node *n;
+	struct device *dev;
+	unsigned long flags;
+	u64 avg;
+
+	if (!cgroup_lock_live_group(cgroup))
+		return -ENODEV;
+
+	bgrp = cgroup_to_bfqio(cgroup);
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(bfqg, n, &bgrp->group_data, group_node) {
+		bfqd = bfq_get_bfqd_locked(&bfqg->bfqd, &flags);
+		if (bfqd == NULL)
+			continue;
+
+		avg = bfqg->lat_total;
+		if (bfqg->lat_count != 0)
+			do_div(avg, bfqg->lat_count);
+
+		dev = bfqd->queue->backing_dev_info.dev;
+		seq_printf(m, "%s %lu %u %u\n", dev ? dev_name(dev) : "?",
+			   bfqg->lat_count, jiffies_to_msecs((unsigned long)avg),
+			   jiffies_to_msecs(bfqg->lat_max));
+
+		bfq_put_bfqd_unlock(bfqd, &flags);
+	}
+	rcu_read_unlock();
+
+	cgroup_unlock();
+
+	return 0;
+}
+
 static struct cftype bfqio_files[] = {
 	{
 		.name = "weight",
@@ -602,6 +694,15 @@ static struct cftype bfqio_files[] = {
 		.read_u64 = bfqio_cgroup_ioprio_class_read,
 		.write_u64 = bfqio_cgroup_ioprio_class_write,
 	},
+	{
+		.name = "foreground",
+		.read_u64 = bfqio_cgroup_foreground_read,
+		.write_u64 = bfqio_cgroup_foreground_write,
+	},
+	{
+		.name = "latency",
+		.read_seq_string = bfqio_cgroup_latency_read,
+	},
 };
 
 static int bfqio_populate(struct cgroup_subsys *subsys, struct cgroup *cgroup)
@@ -728,6 +829,16 @@ static inline void bfq_init_entity(struct bfq_entity *entity,
 	entity->sched_data = &bfqg->sched_data;
 }
 
+static inline int bfq_group_foreground(struct bfq_group *bfqg)
+{
+	return 0;
+}
+
+static inline void bfq_group_account_latency(struct bfq_group *bfqg,
+					     struct request *rq)
+{
+}
+
 static inline struct bfq_group *
 bfq_cic_update_cgroup(struct cfq_io_context *cic)
 {
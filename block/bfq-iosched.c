@@ -59,6 +59,7 @@
 #include <linux/elevator.h>
 #include <linux/rbtree.h>
 #include <linux/ioprio.h>
+#include <linux/seq_file.h>
 #include "bfq.h"
 
 /* Max number of dispatches in one round of service. */
@@ -581,6 +582,27 @@ static inline bfq_service_t bfq_min_budget(struct bfq_data *bfqd)
 		bfqd->bfq_max_budget / 32;
 }
 
+static inline struct bfq_group *bfq_bfqq_group(struct bfq_queue *bfqq)
+{
+	return container_of(bfqq->entity.sched_data, struct bfq_group,
+			    sched_data);
+}
+
+/*
+ * Idling on flash does not save any seek, it only leaves the device
+ * unused.  In flash mode keep it for the queues it buys latency for:
+ * weight-raised ones (applications being started) and the ones in
+ * foreground groups.
+ */
+static inline int bfq_may_idle(struct bfq_data *bfqd, struct bfq_queue *bfqq)
+{
+	if (!bfqd->flash_mode || !blk_queue_nonrot(bfqd->queue))
+		return 1;
+
+	return bfqq->raising_coeff > 1 ||
+		bfq_group_foreground(bfq_bfqq_group(bfqq));
+}
+
 static void bfq_arm_slice_timer(struct bfq_data *bfqd)
 {
 	struct bfq_queue *bfqq = bfqd->active_queue;
@@ -589,8 +611,12 @@ static void bfq_arm_slice_timer(struct bfq_data *bfqd)
 
 	WARN_ON(!RB_EMPTY_ROOT(&bfqq->sort_list));
 
-	/* Idling is disabled, either manually or by past process history. */
-	if (bfqd->bfq_slice_idle == 0 || !bfq_bfqq_idle_window(bfqq))
+	/*
+	 * Idling is disabled, either manually, by past process history or
+	 * because the device does not seek.
+	 */
+	if (bfqd->bfq_slice_idle == 0 || !bfq_bfqq_idle_window(bfqq) ||
+	    !bfq_may_idle(bfqd, bfqq))
 		return;
 
 	/* Tasks have exited, don't wait. */
@@ -1633,7 +1659,7 @@ static void bfq_update_idle_window(struct bfq_data *bfqd,
 	enable_idle = bfq_bfqq_idle_window(bfqq);
 
 	if (atomic_read(&cic->ioc->nr_tasks) == 0 ||
-	    bfqd->bfq_slice_idle == 0 ||
+	    bfqd->bfq_slice_idle == 0 || !bfq_may_idle(bfqd, bfqq) ||
 		(bfqd->hw_tag && BFQQ_SEEKY(bfqq) &&
 			bfqq->raising_coeff == 1))
 		enable_idle = 0;
@@ -1774,8 +1800,10 @@ static void bfq_completed_request(struct request_queue *q, struct request *rq)
 	if (bfq_bfqq_sync(bfqq))
 		bfqd->sync_flight--;
 
-	if (sync)
+	if (sync) {
 		RQ_CIC(rq)->last_end_request = jiffies;
+		bfq_group_account_latency(bfq_bfqq_group(bfqq), rq);
+	}
 
 	/*
 	 * If this is the active queue, check if it needs to be expired,
@@ -2159,6 +2187,8 @@ static void *bfq_init_queue(struct request_queue *q)
 	bfqd->bfq_raising_min_idle_time = msecs_to_jiffies(2000);
 	bfqd->bfq_raising_max_softrt_rate = 7000;
 
+	bfqd->flash_mode = true;
+
 	return bfqd;
 }
 
@@ -2249,6 +2279,7 @@ SHOW_FUNCTION(bfq_raising_min_idle_time_show, bfqd->bfq_raising_min_idle_time,
 	1);
 SHOW_FUNCTION(bfq_raising_max_softrt_rate_show,
 	bfqd->bfq_raising_max_softrt_rate, 0);
+SHOW_FUNCTION(bfq_flash_mode_show, bfqd->flash_mode, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -2361,6 +2392,20 @@ static ssize_t bfq_low_latency_store(struct elevator_queue *e,
 	return ret;
 }
 
+static ssize_t bfq_flash_mode_store(struct elevator_queue *e,
+				    const char *page, size_t count)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+	unsigned int __data;
+	int ret = bfq_var_store(&__data, (page), count);
+
+	if (__data > 1)
+		__data = 1;
+	bfqd->flash_mode = __data;
+
+	return ret;
+}
+
 #define BFQ_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, bfq_##name##_show, bfq_##name##_store)
 
@@ -2381,6 +2426,7 @@ static struct elv_fs_entry bfq_attrs[] = {
 	BFQ_ATTR(raising_min_idle_time),
 	BFQ_ATTR(raising_max_softrt_rate),
 	BFQ_ATTR(weights),
+	BFQ_ATTR(flash_mode),
 	__ATTR_NULL
 };
 
@@ -214,6 +214,8 @@ struct bfq_group;
  *			       may be reactivated for a queue (in jiffies)
  * @bfq_raising_max_softrt_rate: max service-rate for a soft real-time queue,
  *			         sectors per seconds
+ * @flash_mode: if the device is non-rotational, idle only for weight-raised
+ *              queues and for queues in foreground groups.
  *
  * All the fields are protected by the @queue lock.
  */
@@ -271,6 +273,8 @@ struct bfq_data {
 	unsigned int bfq_raising_max_time;
 	unsigned int bfq_raising_min_idle_time;
 	unsigned int bfq_raising_max_softrt_rate;
+
+	bool flash_mode;
 };
 
 /**
@@ -410,6 +414,10 @@ enum bfqq_expiration {
  * @async_idle_bfqq: async queue for the idle class (ioprio is ignored).
  * @my_entity: pointer to @entity, %NULL for the toplevel group; used
  *             to avoid too many special cases during group creation/migration.
+ * @foreground: copy of the cgroup's foreground flag.
+ * @lat_count: number of sync requests completed by the group on the device.
+ * @lat_total: sum of their latencies, from allocation to completion (jiffies).
+ * @lat_max: largest of those latencies (jiffies).
  *
  * Each (device, cgroup) pair has its own bfq_group, i.e., for each cgroup
  * there is a set of bfq_groups, each one collecting the lower-level
@@ -435,6 +443,12 @@ struct bfq_group {
 	struct bfq_queue *async_idle_bfqq;
 
 	struct bfq_entity *my_entity;
+
+	int foreground;
+
+	unsigned long lat_count;
+	u64 lat_total;
+	unsigned long lat_max;
 };
 
 /**
@@ -443,6 +457,7 @@ struct bfq_group {
  * @weight: cgroup weight.
  * @ioprio: cgroup ioprio.
  * @ioprio_class: cgroup ioprio_class.
+ * @foreground: keep idling for the group's queues in flash mode.
  * @lock: spinlock that protects @ioprio, @ioprio_class and @group_data.
  * @group_data: list containing the bfq_group belonging to this cgroup.
  *
@@ -453,6 +468,7 @@ struct bfqio_cgroup {
 	struct cgroup_subsys_state css;
 
 	unsigned short weight, ioprio, ioprio_class;
+	unsigned short foreground;
 
 	spinlock_t lock;
 	struct hlist_head group_data;
@@ -0,0 +1,455 @@
+/*
+ *  Flash i/o scheduler.
+ *
+ *  Based on the deadline i/o scheduler, Copyright (C) 2002 Jens Axboe.
+ *
+ *  eMMC and raw NAND have no heads to move, so there is no sector sorting
+ *  of reads, no head direction and no anticipation here. Sync requests are
+ *  served in arrival order ahead of async writes, with deadlines keeping
+ *  either side from starving. Writes are what flash is slow at: they are
+ *  held back while reads are pending and then dispatched in batches that
+ *  stay inside one erase block, in ascending sector order, which is the
+ *  pattern the card's FTL handles best.
+ *
+ *  See Documentation/block/flash-iosched.txt
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/compiler.h>
+#include <linux/rbtree.h>
+
+enum flash_sync {
+	ASYNC,
+	SYNC,
+};
+
+static const int sync_expire = HZ / 8;	/* max time before a sync request is submitted */
+static const int async_expire = 5 * HZ;	/* ditto for async writes, these limits are SOFT! */
+static const int writes_starved = 4;	/* max times sync requests can starve async ones */
+static const int fifo_batch = 16;	/* max requests in one erase block batch */
+static const int erase_block_kb = 512;	/* write batches do not cross this boundary */
+
+struct flash_data {
+	/*
+	 * requests are on both a sort_list (by data direction, for merging
+	 * and write batching) and a fifo_list (by sync/async, for dispatch)
+	 */
+	struct rb_root sort_list[2];
+	struct list_head fifo_list[2];
+
+	/*
+	 * next write in the erase block currently being written, or NULL
+	 */
+	struct request *next_write;
+	unsigned int batched;		/* writes dispatched in this batch */
+	unsigned int starved;		/* times sync requests have starved async */
+
+	/*
+	 * settings that change how the i/o scheduler behaves
+	 */
+	int fifo_expire[2];
+	int fifo_batch;
+	int writes_starved;
+	int erase_block_kb;
+	int front_merges;
+};
+
+static void flash_move_request(struct flash_data *, struct request *);
+
+static inline struct rb_root *
+flash_rb_root(struct flash_data *fd, struct request *rq)
+{
+	return &fd->sort_list[rq_data_dir(rq)];
+}
+
+static inline sector_t
+flash_erase_block(struct flash_data *fd, sector_t sector)
+{
+	sector_div(sector, fd->erase_block_kb * 2);
+	return sector;
+}
+
+/*
+ * get the write after `rq' in sector order, if it lands in the same
+ * erase block
+ */
+static struct request *
+flash_next_in_block(struct flash_data *fd, struct request *rq)
+{
+	struct rb_node *node = rb_next(&rq->rb_node);
+	struct request *next;
+
+	if (!node)
+		return NULL;
+
+	next = rb_entry_rq(node);
+	if (flash_erase_block(fd, blk_rq_pos(next)) !=
+	    flash_erase_block(fd, blk_rq_pos(rq)))
+		return NULL;
+
+	return next;
+}
+
+/*
+ * get the lowest sectored write in the same erase block as `rq', so that
+ * a batch writes the block front to back
+ */
+static struct request *
+flash_first_in_block(struct flash_data *fd, struct request *rq)
+{
+	sector_t block = flash_erase_block(fd, blk_rq_pos(rq));
+	struct rb_node *node;
+
+	while ((node = rb_prev(&rq->rb_node)) != NULL) {
+		struct request *prev = rb_entry_rq(node);
+
+		if (flash_erase_block(fd, blk_rq_pos(prev)) != block)
+			break;
+		rq = prev;
+	}
+
+	return rq;
+}
+
+static void
+flash_add_rq_rb(struct flash_data *fd, struct request *rq)
+{
+	struct rb_root *root = flash_rb_root(fd, rq);
+	struct request *__alias;
+
+	while (unlikely(__alias = elv_rb_add(root, rq)))
+		flash_move_request(fd, __alias);
+}
+
+static inline void
+flash_del_rq_rb(struct flash_data *fd, struct request *rq)
+{
+	if (fd->next_write == rq)
+		fd->next_write = flash_next_in_block(fd, rq);
+
+	elv_rb_del(flash_rb_root(fd, rq), rq);
+}
+
+/*
+ * add rq to rbtree and fifo
+ */
+static void
+flash_add_request(struct request_queue *q, struct request *rq)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+	const int sync = rq_is_sync(rq);
+
+	flash_add_rq_rb(fd, rq);
+
+	rq_set_fifo_time(rq, jiffies + fd->fifo_expire[sync]);
+	list_add_tail(&rq->queuelist, &fd->fifo_list[sync]);
+}
+
+/*
+ * remove rq from rbtree and fifo.
+ */
+static void flash_remove_request(struct request_queue *q, struct request *rq)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+
+	rq_fifo_clear(rq);
+	flash_del_rq_rb(fd, rq);
+}
+
+static int
+flash_merge(struct request_queue *q, struct request **req, struct bio *bio)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+	struct request *__rq;
+
+	/*
+	 * back merges are found by the elevator core, check for front merge
+	 */
+	if (fd->front_merges) {
+		sector_t sector = bio->bi_sector + bio_sectors(bio);
+
+		__rq = elv_rb_find(&fd->sort_list[bio_data_dir(bio)], sector);
+		if (__rq) {
+			BUG_ON(sector != blk_rq_pos(__rq));
+
+			if (elv_rq_merge_ok(__rq, bio)) {
+				*req = __rq;
+				return ELEVATOR_FRONT_MERGE;
+			}
+		}
+	}
+
+	return ELEVATOR_NO_MERGE;
+}
+
+static void flash_merged_request(struct request_queue *q,
+				 struct request *req, int type)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+
+	/*
+	 * if the merge was a front merge, we need to reposition request
+	 */
+	if (type == ELEVATOR_FRONT_MERGE) {
+		elv_rb_del(flash_rb_root(fd, req), req);
+		flash_add_rq_rb(fd, req);
+	}
+}
+
+static void
+flash_merged_requests(struct request_queue *q, struct request *req,
+		      struct request *next)
+{
+	/*
+	 * if next expires before rq, assign its expire time to rq
+	 * and move into next position (next will be deleted) in fifo
+	 */
+	if (!list_empty(&req->queuelist) && !list_empty(&next->queuelist)) {
+		if (time_before(rq_fifo_time(next), rq_fifo_time(req))) {
+			list_move(&req->queuelist, &next->queuelist);
+			rq_set_fifo_time(req, rq_fifo_time(next));
+		}
+	}
+
+	/*
+	 * kill knowledge of next, this one is a goner
+	 */
+	flash_remove_request(q, next);
+}
+
+/*
+ * move an entry to dispatch queue
+ */
+static void
+flash_move_request(struct flash_data *fd, struct request *rq)
+{
+	struct request_queue *q = rq->q;
+
+	/*
+	 * a read does not end the write batch, it is merely let through
+	 */
+	if (rq_data_dir(rq) == WRITE)
+		fd->next_write = flash_next_in_block(fd, rq);
+
+	flash_remove_request(q, rq);
+	elv_dispatch_add_tail(q, rq);
+}
+
+/*
+ * flash_check_fifo returns 0 if there are no expired requests on the fifo,
+ * 1 otherwise. Requires !list_empty(&fd->fifo_list[sync])
+ */
+static inline int flash_check_fifo(struct flash_data *fd, int sync)
+{
+	struct request *rq = rq_entry_fifo(fd->fifo_list[sync].next);
+
+	return time_after(jiffies, rq_fifo_time(rq));
+}
+
+/*
+ * flash_dispatch_requests picks the oldest sync request unless async
+ * writes have waited too long, and keeps writing the current erase block
+ * while nothing sync is overdue
+ */
+static int flash_dispatch_requests(struct request_queue *q, int force)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+	const int sync = !list_empty(&fd->fifo_list[SYNC]);
+	const int async = !list_empty(&fd->fifo_list[ASYNC]);
+	struct request *rq;
+
+	rq = fd->next_write;
+	if (rq && fd->batched < fd->fifo_batch &&
+	    !(sync && flash_check_fifo(fd, SYNC)))
+		goto dispatch_request;
+
+	if (sync) {
+		if (async && (fd->starved++ >= fd->writes_starved ||
+			      flash_check_fifo(fd, ASYNC)))
+			goto dispatch_async;
+
+		rq = rq_entry_fifo(fd->fifo_list[SYNC].next);
+		if (rq_data_dir(rq) == WRITE)
+			fd->batched = 0;
+
+		goto dispatch_request;
+	}
+
+	if (async) {
+dispatch_async:
+		fd->starved = 0;
+		rq = rq_entry_fifo(fd->fifo_list[ASYNC].next);
+		rq = flash_first_in_block(fd, rq);
+		fd->batched = 0;
+
+		goto dispatch_request;
+	}
+
+	return 0;
+
+dispatch_request:
+	if (rq_data_dir(rq) == WRITE)
+		fd->batched++;
+	flash_move_request(fd, rq);
+
+	return 1;
+}
+
+static int flash_queue_empty(struct request_queue *q)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+
+	return list_empty(&fd->fifo_list[SYNC])
+		&& list_empty(&fd->fifo_list[ASYNC]);
+}
+
+static void flash_exit_queue(struct elevator_queue *e)
+{
+	struct flash_data *fd = e->elevator_data;
+
+	BUG_ON(!list_empty(&fd->fifo_list[SYNC]));
+	BUG_ON(!list_empty(&fd->fifo_list[ASYNC]));
+
+	kfree(fd);
+}
+
+/*
+ * initialize elevator private data (flash_data).
+ */
+static void *flash_init_queue(struct request_queue *q)
+{
+	struct flash_data *fd;
+
+	fd = kmalloc_node(sizeof(*fd), GFP_KERNEL | __GFP_ZERO, q->node);
+	if (!fd)
+		return NULL;
+
+	INIT_LIST_HEAD(&fd->fifo_list[SYNC]);
+	INIT_LIST_HEAD(&fd->fifo_list[ASYNC]);
+	fd->sort_list[READ] = RB_ROOT;
+	fd->sort_list[WRITE] = RB_ROOT;
+	fd->fifo_expire[SYNC] = sync_expire;
+	fd->fifo_expire[ASYNC] = async_expire;
+	fd->writes_starved = writes_starved;
+	fd->fifo_batch = fifo_batch;
+	fd->erase_block_kb = erase_block_kb;
+	fd->front_merges = 1;
+	return fd;
+}
+
+/*
+ * sysfs parts below
+ */
+
+static ssize_t
+flash_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t
+flash_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct flash_data *fd = e->elevator_data;			\
+	int __data = __VAR;						\
+	if (__CONV)							\
+		__data = jiffies_to_msecs(__data);			\
+	return flash_var_show(__data, (page));				\
+}
+SHOW_FUNCTION(flash_sync_expire_show, fd->fifo_expire[SYNC], 1);
+SHOW_FUNCTION(flash_async_expire_show, fd->fifo_expire[ASYNC], 1);
+SHOW_FUNCTION(flash_writes_starved_show, fd->writes_starved, 0);
+SHOW_FUNCTION(flash_fifo_batch_show, fd->fifo_batch, 0);
+SHOW_FUNCTION(flash_erase_block_kb_show, fd->erase_block_kb, 0);
+SHOW_FUNCTION(flash_front_merges_show, fd->front_merges, 0);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct flash_data *fd = e->elevator_data;			\
+	int __data;							\
+	int ret = flash_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV)							\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else								\
+		*(__PTR) = __data;					\
+	return ret;							\
+}
+STORE_FUNCTION(flash_sync_expire_store, &fd->fifo_expire[SYNC], 0, INT_MAX, 1);
+STORE_FUNCTION(flash_async_expire_store, &fd->fifo_expire[ASYNC], 0, INT_MAX, 1);
+STORE_FUNCTION(flash_writes_starved_store, &fd->writes_starved, 0, INT_MAX, 0);
+STORE_FUNCTION(flash_fifo_batch_store, &fd->fifo_batch, 1, INT_MAX, 0);
+STORE_FUNCTION(flash_erase_block_kb_store, &fd->erase_block_kb, 1, INT_MAX / 2, 0);
+STORE_FUNCTION(flash_front_merges_store, &fd->front_merges, 0, 1, 0);
+#undef STORE_FUNCTION
+
+#define FD_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, flash_##name##_show, \
+				      flash_##name##_store)
+
+static struct elv_fs_entry flash_attrs[] = {
+	FD_ATTR(sync_expire),
+	FD_ATTR(async_expire),
+	FD_ATTR(writes_starved),
+	FD_ATTR(fifo_batch),
+	FD_ATTR(erase_block_kb),
+	FD_ATTR(front_merges),
+	__ATTR_NULL
+};
+
+static struct elevator_type iosched_flash = {
+	.ops = {
+		.elevator_merge_fn = 		flash_merge,
+		.elevator_merged_fn =		flash_merged_request,
+		.elevator_merge_req_fn =	flash_merged_requests,
+		.elevator_dispatch_fn =		flash_dispatch_requests,
+		.elevator_add_req_fn =		flash_add_request,
+		.elevator_queue_empty_fn =	flash_queue_empty,
+		.elevator_former_req_fn =	elv_rb_former_request,
+		.elevator_latter_req_fn =	elv_rb_latter_request,
+		.elevator_init_fn =		flash_init_queue,
+		.elevator_exit_fn =		flash_exit_queue,
+	},
+
+	.elevator_attrs = flash_attrs,
+	.elevator_name = "flash",
+	.elevator_owner = THIS_MODULE,
+};
+
+static int __init flash_init(void)
+{
+	elv_register(&iosched_flash);
+
+	return 0;
+}
+
+static void __exit flash_exit(void)
+{
+	elv_unregister(&iosched_flash);
+}
+
+module_init(flash_init);
+module_exit(flash_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Flash IO scheduler");
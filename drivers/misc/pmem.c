@@ -23,6 +23,9 @@
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
@@ -30,6 +33,8 @@
 #define PMEM_MAX_DEVICES 10
 #define PMEM_MAX_ORDER 128
 #define PMEM_MIN_ALLOC PAGE_SIZE
+/* orders that can have a free list, must not exceed PMEM_MAX_ORDER */
+#define PMEM_NUM_ORDERS BITS_PER_LONG
 
 #define PMEM_DEBUG 1
 
@@ -82,6 +87,13 @@ struct pmem_data {
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
 	unsigned order:7;		/* size of the region in pmem space */
+	/* 1 if the allocation was asked for as movable and nobody has been
+	 * given its address since, so it can still be relocated */
+	unsigned movable:1;
+	/* links in the free list of this order, only valid for the first
+	 * entry of a free region, -1 terminates */
+	int prev_free;
+	int next_free;
 };
 
 struct pmem_region_node {
@@ -116,6 +128,22 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* first entry of the free regions of each order, -1 if none, and
+	 * a bit per order that has any, so the best fit is found with a
+	 * single bit search */
+	int free_head[PMEM_NUM_ORDERS];
+	unsigned long free_orders;
+	/* number of free regions of each order */
+	unsigned long nr_free[PMEM_NUM_ORDERS];
+	/* allocation stats, protected like the bitmap */
+	unsigned long alloc_count;
+	unsigned long alloc_failed;
+	u64 alloc_ns_total;
+	u32 alloc_ns_max;
+	/* regions emptied by moving movable allocations out of the way */
+	unsigned long defrag_count;
+	unsigned long defrag_ok;
+	unsigned long defrag_moved;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -142,6 +170,8 @@ struct pmem_info {
 	 *
 	 * IF YOU TAKE BOTH LOCKS TAKE THEM IN THIS ORDER:
 	 * down(pmem_data->sem) => down(bitmap_sem)
+	 *
+	 * the free lists and allocation stats are protected the same way
 	 */
 	struct rw_semaphore bitmap_sem;
 
@@ -232,6 +262,41 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+/* add the free region starting at index to the free list of its order */
+static void pmem_free_list_add(int id, int index)
+{
+	int order = PMEM_ORDER(id, index);
+	int head = pmem[id].free_head[order];
+
+	pmem[id].bitmap[index].allocated = 0;
+	pmem[id].bitmap[index].movable = 0;
+	pmem[id].bitmap[index].prev_free = -1;
+	pmem[id].bitmap[index].next_free = head;
+	if (head >= 0)
+		pmem[id].bitmap[head].prev_free = index;
+	pmem[id].free_head[order] = index;
+	pmem[id].free_orders |= 1UL << order;
+	pmem[id].nr_free[order]++;
+}
+
+/* take the free region starting at index off the free list of its order */
+static void pmem_free_list_del(int id, int index)
+{
+	int order = PMEM_ORDER(id, index);
+	int prev = pmem[id].bitmap[index].prev_free;
+	int next = pmem[id].bitmap[index].next_free;
+
+	if (prev >= 0)
+		pmem[id].bitmap[prev].next_free = next;
+	else
+		pmem[id].free_head[order] = next;
+	if (next >= 0)
+		pmem[id].bitmap[next].prev_free = prev;
+	if (pmem[id].free_head[order] < 0)
+		pmem[id].free_orders &= ~(1UL << order);
+	pmem[id].nr_free[order]--;
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
@@ -242,23 +307,25 @@ static int pmem_free(int id, int index)
 		pmem[id].allocated = 0;
 		return 0;
 	}
-	/* clean up the bitmap, merging any buddies */
-	pmem[id].bitmap[curr].allocated = 0;
+	pmem[id].bitmap[index].movable = 0;
 	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
-	 * repeat until the buddy is not free or end of the bitmap is reached
+	 * if the buddy is also free, take it off its free list and merge
+	 * repeat until the buddy is not free or lies past the end of the
+	 * region, then put what was merged on the free list of its order
 	 */
-	do {
+	while (1) {
 		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
+		if (buddy + (1 << PMEM_ORDER(id, curr)) >
+				pmem[id].num_entries ||
+		    !PMEM_IS_FREE(id, buddy) ||
+		    PMEM_ORDER(id, buddy) != PMEM_ORDER(id, curr))
 			break;
-		}
-	} while (curr < pmem[id].num_entries);
+		pmem_free_list_del(id, buddy);
+		PMEM_ORDER(id, buddy)++;
+		PMEM_ORDER(id, curr)++;
+		curr = min(buddy, curr);
+	}
+	pmem_free_list_add(id, curr);
 
 	return 0;
 }
@@ -376,14 +443,174 @@ static unsigned long pmem_order(unsigned long len)
 	return i;
 }
 
+static void pmem_account_alloc(int id, ktime_t start, int failed)
+{
+	u32 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	pmem[id].alloc_count++;
+	if (failed)
+		pmem[id].alloc_failed++;
+	pmem[id].alloc_ns_total += ns;
+	if (ns > pmem[id].alloc_ns_max)
+		pmem[id].alloc_ns_max = ns;
+}
+
+/* take a region of the given order off the free lists, splitting a larger
+ * one if that is the best fit, caller holds the write lock on pmem_sem */
+static int pmem_alloc_order(int id, unsigned long order)
+{
+	int best_fit;
+	unsigned long orders;
+
+	/* the best fit is the head of the first non empty free list of
+	 * at least the requested order
+	 */
+	orders = pmem[id].free_orders & ~((1UL << order) - 1);
+	if (!orders)
+		return -1;
+	best_fit = pmem[id].free_head[__ffs(orders)];
+	pmem_free_list_del(id, best_fit);
+
+	/* now partition the best fit:
+	 * 	split the slot into 2 buddies of order - 1
+	 * 	and free the upper one
+	 * 	repeat until the slot is of the correct order
+	 */
+	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
+		int buddy;
+		PMEM_ORDER(id, best_fit) -= 1;
+		buddy = PMEM_BUDDY_INDEX(id, best_fit);
+		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+		pmem_free_list_add(id, buddy);
+	}
+	pmem[id].bitmap[best_fit].allocated = 1;
+	return best_fit;
+}
+
+/* move the movable allocation at index out of the window being emptied,
+ * the old region is left allocated for the caller to free. the owner's
+ * sem is only tried, the caller may hold the sem of the allocating file */
+static int pmem_move(int id, int index)
+{
+	struct pmem_data *data;
+	unsigned char __iomem *from, *to;
+	unsigned long len = PMEM_LEN(id, index);
+	int dest;
+
+	list_for_each_entry(data, &pmem[id].data_list, list)
+		if (data->index == index &&
+		    !(data->flags & PMEM_FLAGS_CONNECTED))
+			break;
+	if (&data->list == &pmem[id].data_list)
+		return -1;
+	if (!down_write_trylock(&data->sem))
+		return -1;
+
+	dest = pmem_alloc_order(id, PMEM_ORDER(id, index));
+	if (dest < 0) {
+		up_write(&data->sem);
+		return -1;
+	}
+	DLOG("move %d to %d\n", index, dest);
+
+	/* nothing maps it and nobody knows its address, copy the contents
+	 * and point the file at the new region */
+	from = pmem[id].vbase + PMEM_OFFSET(index);
+	to = pmem[id].vbase + PMEM_OFFSET(dest);
+	memcpy((void __force *)to, (void __force *)from, len);
+	if (pmem[id].cached)
+		dmac_flush_range((void __force *)to, (void __force *)to + len);
+
+	data->index = dest;
+	pmem[id].bitmap[dest].movable = 1;
+	pmem[id].bitmap[index].movable = 0;
+	pmem[id].defrag_moved += 1UL << PMEM_ORDER(id, dest);
+	up_write(&data->sem);
+	return 0;
+}
+
+/* there is enough free space for a region of the order but it is
+ * scattered: pick the aligned window of that size that takes the fewest
+ * entries of movable allocations to empty, move them elsewhere and free
+ * the window as one region.
+ * caller holds the write lock on pmem_sem, and maybe the sem of the file
+ * allocating, so data_list_sem is only tried. returns 0 if it worked */
+static int pmem_defrag(int id, unsigned long order)
+{
+	unsigned long size = 1UL << order, free = 0, cost = 0;
+	unsigned long best_cost = ULONG_MAX;
+	int i, next, window = -1, best = -1, usable = 0, ret = 0;
+
+	for (i = 0; i < PMEM_NUM_ORDERS; i++)
+		free += pmem[id].nr_free[i] << i;
+	if (free < size)
+		return -1;
+
+	/* regions are aligned to their size, so each one either lies inside
+	 * a window or covers whole windows, the last pass closes the last
+	 * window */
+	for (i = 0; ; i = PMEM_NEXT_INDEX(id, i)) {
+		if (i >= pmem[id].num_entries || (i >> order) != window) {
+			if (window >= 0 && usable && cost < best_cost) {
+				best = window;
+				best_cost = cost;
+			}
+			if (i >= pmem[id].num_entries)
+				break;
+			window = i >> order;
+			usable = ((window + 1UL) << order) <= pmem[id].num_entries;
+			cost = 0;
+		}
+		if (PMEM_ORDER(id, i) >= order) {
+			usable = 0;
+			continue;
+		}
+		if (PMEM_IS_FREE(id, i))
+			continue;
+		if (!pmem[id].bitmap[i].movable)
+			usable = 0;
+		cost += 1UL << PMEM_ORDER(id, i);
+	}
+	if (best < 0)
+		return -1;
+	if (down_trylock(&pmem[id].data_list_sem))
+		return -1;
+	pmem[id].defrag_count++;
+
+	/* hold on to the free space in the window so nothing moves into it */
+	for (i = best << order; i < (best + 1) << order;
+	     i = PMEM_NEXT_INDEX(id, i))
+		if (PMEM_IS_FREE(id, i)) {
+			pmem_free_list_del(id, i);
+			pmem[id].bitmap[i].allocated = 1;
+		}
+	for (i = best << order; i < (best + 1) << order;
+	     i = PMEM_NEXT_INDEX(id, i))
+		if (pmem[id].bitmap[i].movable && pmem_move(id, i)) {
+			ret = -1;
+			break;
+		}
+	/* give back what was held or moved away, if every move worked it
+	 * merges into one region of the order */
+	for (i = best << order; i < (best + 1) << order; i = next) {
+		next = PMEM_NEXT_INDEX(id, i);
+		if (!pmem[id].bitmap[i].movable)
+			pmem_free(id, i);
+	}
+	up(&pmem[id].data_list_sem);
+
+	if (!ret)
+		pmem[id].defrag_ok++;
+	return ret;
+}
+
 static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
-	int best_fit = -1;
+	int best_fit;
 	unsigned long order = pmem_order(len);
+	ktime_t start;
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
@@ -393,51 +620,38 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (order > PMEM_MAX_ORDER || order >= PMEM_NUM_ORDERS)
 		return -1;
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
-	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
-	}
+	start = ktime_get();
 
-	/* if best_fit < 0, there are no suitable slots,
-	 * return an error
-	 */
+	best_fit = pmem_alloc_order(id, order);
+	if (best_fit < 0 && !pmem_defrag(id, order))
+		best_fit = pmem_alloc_order(id, order);
 	if (best_fit < 0) {
+		pmem_account_alloc(id, start, 1);
 		printk("pmem: no space left to allocate!\n");
 		return -1;
 	}
-
-	/* now partition the best fit:
-	 * 	split the slot into 2 buddies of order - 1
-	 * 	repeat until the slot is of the correct order
-	 */
-	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
-		int buddy;
-		PMEM_ORDER(id, best_fit) -= 1;
-		buddy = PMEM_BUDDY_INDEX(id, best_fit);
-		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
-	}
-	pmem[id].bitmap[best_fit].allocated = 1;
+	pmem_account_alloc(id, start, 0);
 	return best_fit;
 }
 
+/* the address of the allocation is being handed out, from now on it has
+ * to stay where it is. caller holds data->sem */
+static void pmem_pin(int id, struct pmem_data *data)
+{
+	/* the bit is only set by the allocation and by moves, both of which
+	 * hold data->sem for writing */
+	if (pmem[id].no_allocator || data->index < 0 ||
+	    !pmem[id].bitmap[data->index].movable)
+		return;
+	down_write(&pmem[id].bitmap_sem);
+	pmem[id].bitmap[data->index].movable = 0;
+	up_write(&pmem[id].bitmap_sem);
+}
+
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
@@ -627,6 +841,7 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		goto error;
 	}
 
+	pmem_pin(id, data);
 	vma->vm_pgoff = pmem_start_addr(id, data) >> PAGE_SHIFT;
 	vma->vm_page_prot = phys_mem_access_prot(file, vma->vm_page_prot);
 
@@ -722,6 +937,7 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 	id = get_id(file);
 
 	down_read(&data->sem);
+	pmem_pin(id, data);
 	*start = pmem_start_addr(id, data);
 	*len = pmem_len(id, data);
 	*vstart = (unsigned long)pmem_start_vaddr(id, data);
@@ -825,7 +1041,7 @@ static int pmem_connect(unsigned long connect, struct file *file)
 	struct pmem_data *data = (struct pmem_data *)file->private_data;
 	struct pmem_data *src_data;
 	struct file *src_file;
-	int ret = 0, put_needed;
+	int ret = 0, put_needed, id = get_id(file);
 
 	down_write(&data->sem);
 	/* retrieve the src file and check it is a pmem file with an alloc */
@@ -844,13 +1060,20 @@ static int pmem_connect(unsigned long connect, struct file *file)
 	}
 	src_data = (struct pmem_data *)src_file->private_data;
 
+	/* the src allocation can't be moved once it is shared, pin it and
+	 * read its index under the bitmap lock so a move can't race this */
+	down_write(&pmem[id].bitmap_sem);
 	if (has_allocation(file) && (data->index != src_data->index)) {
+		up_write(&pmem[id].bitmap_sem);
 		printk("pmem: file is already mapped but doesn't match this"
 		       " src_file!\n");
 		ret = -EINVAL;
 		goto err_bad_file;
 	}
+	if (!pmem[id].no_allocator)
+		pmem[id].bitmap[src_data->index].movable = 0;
 	data->index = src_data->index;
+	up_write(&pmem[id].bitmap_sem);
 	data->flags |= PMEM_FLAGS_CONNECTED;
 	data->master_fd = connect;
 	data->master_file = src_file;
@@ -1060,8 +1283,11 @@ static void pmem_get_size(struct pmem_region *region, struct file *file)
 		region->len = 0;
 		return;
 	} else {
+		down_read(&data->sem);
+		pmem_pin(id, data);
 		region->offset = pmem_start_addr(id, data);
 		region->len = pmem_len(id, data);
+		up_read(&data->sem);
 	}
 	DLOG("offset %lx len %lx\n", region->offset, region->len);
 }
@@ -1082,8 +1308,11 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				region.len = 0;
 			} else {
 				data = (struct pmem_data *)file->private_data;
+				down_read(&data->sem);
+				pmem_pin(id, data);
 				region.offset = pmem_start_addr(id, data);
 				region.len = pmem_len(id, data);
+				up_read(&data->sem);
 			}
 			printk(KERN_INFO "pmem: request for physical address of pmem region "
 					"from process %d.\n", current->pid);
@@ -1135,11 +1364,17 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 	case PMEM_ALLOCATE:
+	case PMEM_ALLOCATE_MOVABLE:
 		{
 			if (has_allocation(file))
 				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
+			down_write(&pmem[id].bitmap_sem);
 			data->index = pmem_allocate(id, arg);
+			if (cmd == PMEM_ALLOCATE_MOVABLE && data->index >= 0 &&
+			    !pmem[id].no_allocator)
+				pmem[id].bitmap[data->index].movable = 1;
+			up_write(&pmem[id].bitmap_sem);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1165,12 +1400,188 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 }
 
 #if PMEM_DEBUG
+/* allocation sizes used by the stress test, in entries: 1 << order max */
+#define PMEM_STRESS_SLOTS 32
+#define PMEM_STRESS_MAX_ORDER 6
+
 static ssize_t debug_open(struct inode *inode, struct file *file)
 {
 	file->private_data = inode->i_private;
 	return 0;
 }
 
+/* free space per order, how scattered it is and allocation latency */
+static int debug_alloc_stats(int id, char *buf, int size)
+{
+	unsigned long free = 0, largest = 0, avg_ns = 0;
+	u64 total_ns;
+	int order, n;
+
+	down_read(&pmem[id].bitmap_sem);
+	n = scnprintf(buf, size, "free regions (order:count):");
+	for (order = 0; order < PMEM_NUM_ORDERS; order++) {
+		if (!pmem[id].nr_free[order])
+			continue;
+		n += scnprintf(buf + n, size - n, " %d:%lu", order,
+			       pmem[id].nr_free[order]);
+		free += pmem[id].nr_free[order] << order;
+		largest = 1UL << order;
+	}
+	/* fragmentation: the share of free space outside the largest
+	 * free region */
+	n += scnprintf(buf + n, size - n, "\nfree %lu kB, largest %lu kB, "
+		       "fragmentation %lu%%\n",
+		       free * PMEM_MIN_ALLOC >> 10,
+		       largest * PMEM_MIN_ALLOC >> 10,
+		       free ? 100 - largest * 100 / free : 0);
+	if (pmem[id].alloc_count) {
+		total_ns = pmem[id].alloc_ns_total;
+		do_div(total_ns, pmem[id].alloc_count);
+		avg_ns = total_ns;
+	}
+	n += scnprintf(buf + n, size - n, "allocations %lu, failed %lu, "
+		       "latency avg %lu ns, max %u ns\n",
+		       pmem[id].alloc_count, pmem[id].alloc_failed,
+		       avg_ns, pmem[id].alloc_ns_max);
+	n += scnprintf(buf + n, size - n, "defrag %lu, succeeded %lu, "
+		       "moved %lu kB\n", pmem[id].defrag_count,
+		       pmem[id].defrag_ok,
+		       pmem[id].defrag_moved * PMEM_MIN_ALLOC >> 10);
+	up_read(&pmem[id].bitmap_sem);
+
+	return n;
+}
+
+/* check the free lists against the bitmap, caller holds bitmap_sem */
+static int pmem_check_free_lists(int id)
+{
+	unsigned long listed = 0, free = 0, count;
+	int order, index, prev;
+
+	for (order = 0; order < PMEM_NUM_ORDERS; order++) {
+		count = 0;
+		prev = -1;
+		for (index = pmem[id].free_head[order]; index >= 0;
+		     index = pmem[id].bitmap[index].next_free) {
+			if (!PMEM_IS_FREE(id, index) ||
+			    PMEM_ORDER(id, index) != order ||
+			    pmem[id].bitmap[index].prev_free != prev ||
+			    ++count > pmem[id].num_entries)
+				return -EINVAL;
+			prev = index;
+		}
+		if (count != pmem[id].nr_free[order] ||
+		    !!count != !!(pmem[id].free_orders & (1UL << order)))
+			return -EINVAL;
+		listed += count << order;
+	}
+
+	for (index = 0; index < pmem[id].num_entries;
+	     index = PMEM_NEXT_INDEX(id, index))
+		if (PMEM_IS_FREE(id, index))
+			free += 1UL << PMEM_ORDER(id, index);
+
+	return listed == free ? 0 : -EINVAL;
+}
+
+/* replays the same pseudo random allocate/free trace for a given number of
+ * cycles, then everything is freed and checked. each slot is a pmem_data on
+ * the data list like an open file, so movable allocations can be moved to
+ * make room for the ones that would fail */
+static int pmem_stress(int id, unsigned long cycles, int movable,
+		       unsigned long *tried, unsigned long *done)
+{
+	struct pmem_data *slot;
+	unsigned long i, len;
+	u32 seed = 1;
+	int s, ret;
+
+	if (pmem[id].no_allocator)
+		return -EINVAL;
+
+	slot = kcalloc(PMEM_STRESS_SLOTS, sizeof(*slot), GFP_KERNEL);
+	if (!slot)
+		return -ENOMEM;
+	down(&pmem[id].data_list_sem);
+	for (s = 0; s < PMEM_STRESS_SLOTS; s++) {
+		slot[s].index = -1;
+		init_rwsem(&slot[s].sem);
+		INIT_LIST_HEAD(&slot[s].region_list);
+		list_add(&slot[s].list, &pmem[id].data_list);
+	}
+	up(&pmem[id].data_list_sem);
+
+	*tried = *done = 0;
+	for (i = 0; i < cycles; i++) {
+		seed = seed * 1103515245 + 12345;
+		s = (seed >> 16) % PMEM_STRESS_SLOTS;
+		down_write(&pmem[id].bitmap_sem);
+		if (slot[s].index >= 0) {
+			pmem_free(id, slot[s].index);
+			slot[s].index = -1;
+		} else {
+			seed = seed * 1103515245 + 12345;
+			len = ((seed >> 16) % (1 << PMEM_STRESS_MAX_ORDER) + 1) *
+				PMEM_MIN_ALLOC;
+			slot[s].index = pmem_allocate(id, len);
+			(*tried)++;
+			if (slot[s].index >= 0) {
+				(*done)++;
+				pmem[id].bitmap[slot[s].index].movable = movable;
+			}
+		}
+		up_write(&pmem[id].bitmap_sem);
+		cond_resched();
+	}
+
+	down(&pmem[id].data_list_sem);
+	for (s = 0; s < PMEM_STRESS_SLOTS; s++)
+		list_del(&slot[s].list);
+	up(&pmem[id].data_list_sem);
+
+	down_write(&pmem[id].bitmap_sem);
+	for (s = 0; s < PMEM_STRESS_SLOTS; s++)
+		if (slot[s].index >= 0)
+			pmem_free(id, slot[s].index);
+	ret = pmem_check_free_lists(id);
+	up_write(&pmem[id].bitmap_sem);
+	kfree(slot);
+
+	return ret;
+}
+
+/* writing a number runs that many stress test cycles on the region, once
+ * with fixed allocations and once with movable ones */
+static ssize_t debug_write(struct file *file, const char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	int id = (int)file->private_data;
+	unsigned long cycles, tried = 0, done = 0, tried_mv = 0, done_mv = 0;
+	char kbuf[16];
+	int ret;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+	kbuf[count] = 0;
+	if (strict_strtoul(strim(kbuf), 0, &cycles))
+		return -EINVAL;
+
+	ret = pmem_stress(id, cycles, 0, &tried, &done);
+	if (!ret)
+		ret = pmem_stress(id, cycles, 1, &tried_mv, &done_mv);
+	printk(KERN_INFO "pmem: %s: %lu allocate/free cycles %s\n",
+	       pmem[id].dev.name, cycles, ret ? "FAILED" : "passed");
+	if (!ret && tried && tried_mv)
+		printk(KERN_INFO "pmem: %s: allocations succeeded %lu/%lu "
+		       "(%lu%%) fixed, %lu/%lu (%lu%%) movable\n",
+		       pmem[id].dev.name, done, tried, done * 100 / tried,
+		       done_mv, tried_mv, done_mv * 100 / tried_mv);
+
+	return ret ? ret : count;
+}
+
 static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 			  loff_t *ppos)
 {
@@ -1205,6 +1616,9 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 	}
 	up(&pmem[id].data_list_sem);
 
+	if (!pmem[id].no_allocator)
+		n += debug_alloc_stats(id, buffer + n, debug_bufmax - n - 1);
+
 	n++;
 	buffer[n] = 0;
 	return simple_read_from_buffer(buf, count, ppos, buffer, n);
@@ -1212,6 +1626,7 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 
 static struct file_operations debug_fops = {
 	.read = debug_read,
+	.write = debug_write,
 	.open = debug_open,
 };
 #endif
@@ -1254,17 +1669,21 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	}
 	pmem[id].num_entries = pmem[id].size / PMEM_MIN_ALLOC;
 
-	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
-				  sizeof(struct pmem_bits), GFP_KERNEL);
+	pmem[id].bitmap = vmalloc(pmem[id].num_entries *
+				  sizeof(struct pmem_bits));
 	if (!pmem[id].bitmap)
 		goto err_no_mem_for_metadata;
 
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
 
+	for (i = 0; i < PMEM_NUM_ORDERS; i++)
+		pmem[id].free_head[i] = -1;
+
 	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
 		if ((pmem[id].num_entries) &  1<<i) {
 			PMEM_ORDER(id, index) = i;
+			pmem_free_list_add(id, index);
 			index = PMEM_NEXT_INDEX(id, index);
 		}
 	}
@@ -1288,12 +1707,12 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 		pmem[id].allocated = 0;
 
 #if PMEM_DEBUG
-	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
-			    &debug_fops);
+	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO | S_IWUSR, NULL,
+			    (void *)id, &debug_fops);
 #endif
 	return 0;
 error_cant_remap:
-	kfree(pmem[id].bitmap);
+	vfree(pmem[id].bitmap);
 err_no_mem_for_metadata:
 	misc_deregister(&pmem[id].dev);
 err_cant_register_device:
@@ -149,13 +149,6 @@ static const struct block_device_operations mmc_bdops = {
 	.owner			= THIS_MODULE,
 };
 
-struct mmc_blk_request {
-	struct mmc_request	mrq;
-	struct mmc_command	cmd;
-	struct mmc_command	stop;
-	struct mmc_data		data;
-};
-
 static u32 mmc_sd_num_wr_blocks(struct mmc_card *card)
 {
 	int err;
@@ -291,11 +284,157 @@ static void remove_card(struct mmc_host *host)
 	mmc_schedule_card_removal_work(&host->remove, 0);
 }
 
+/*
+ * Build the MMC request for (the rest of) mqrq->req and get its data ready
+ * for the host: map the sg list, fill the bounce buffer and let the host
+ * driver map it for DMA. This is also done for the next request while the
+ * current one is on the bus.
+ */
+static void mmc_blk_rw_rq_prep(struct mmc_queue_req *mqrq,
+			       struct mmc_card *card, int disable_multi,
+			       struct mmc_queue *mq)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	u32 readcmd, writecmd;
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+
+	brq->cmd.arg = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	brq->data.blksz = 512;
+	brq->stop.opcode = MMC_STOP_TRANSMISSION;
+	brq->stop.arg = 0;
+	brq->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	brq->data.blocks = blk_rq_sectors(req);
+
+	/*
+	 * The block layer doesn't support all sector count
+	 * restrictions, so we need to be prepared for too big
+	 * requests.
+	 */
+	if (brq->data.blocks > card->host->max_blk_count)
+		brq->data.blocks = card->host->max_blk_count;
+
+	/*
+	 * After a read error, we redo the request one sector at a time
+	 * in order to accurately determine which sectors can be read
+	 * successfully.
+	 */
+	if (disable_multi && brq->data.blocks > 1)
+		brq->data.blocks = 1;
+
+	if (brq->data.blocks > 1) {
+		/* SPI multiblock writes terminate using a special
+		 * token, not a STOP_TRANSMISSION request.
+		 */
+		if (!mmc_host_is_spi(card->host)
+				|| rq_data_dir(req) == READ)
+			brq->mrq.stop = &brq->stop;
+		readcmd = MMC_READ_MULTIPLE_BLOCK;
+		writecmd = MMC_WRITE_MULTIPLE_BLOCK;
+	} else {
+		brq->mrq.stop = NULL;
+		readcmd = MMC_READ_SINGLE_BLOCK;
+		writecmd = MMC_WRITE_BLOCK;
+	}
+
+	if (rq_data_dir(req) == READ) {
+		brq->cmd.opcode = readcmd;
+		brq->data.flags |= MMC_DATA_READ;
+	} else {
+		brq->cmd.opcode = writecmd;
+		brq->data.flags |= MMC_DATA_WRITE;
+
+#if defined(CONFIG_ARCH_MSM7X30)
+	if (board_emmc_boot())
+		if (mmc_card_mmc(card)) {
+			if (brq->cmd.arg < 131073) {/* should not write any value before 131073 */
+				pr_err("%s: pid %d(tgid %d)(%s)\n", __func__,
+					(unsigned)(current->pid), (unsigned)(current->tgid),
+					current->comm);
+				pr_err("ERROR! Attemp to write radio partition start %d size %d\n"
+					, brq->cmd.arg, blk_rq_sectors(req));
+				BUG();
+
+				return;
+			}
+#if defined(CONFIG_ARCH_MSM7230)
+			if ((brq->cmd.arg > 143361) && (brq->cmd.arg < 163328)) {
+
+				pr_err("%s: pid %d(tgid %d)(%s)\n", __func__,
+					(unsigned)(current->pid), (unsigned)(current->tgid),
+					current->comm);
+				pr_err("ERROR! Attemp to write radio partition start %d size %d\n"
+					, brq->cmd.arg, blk_rq_sectors(req));
+				BUG();
+
+
+				return;
+			}
+#endif
+		}
+#endif
+	}
+
+	mmc_set_data_timeout(&brq->data, card);
+
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
+
+	/*
+	 * Adjust the sg list so it is the same size as the
+	 * request.
+	 */
+	if (brq->data.blocks != blk_rq_sectors(req)) {
+		int i, data_size = brq->data.blocks << 9;
+		struct scatterlist *sg;
+
+		for_each_sg(brq->data.sg, sg, brq->data.sg_len, i) {
+			data_size -= sg->length;
+			if (data_size <= 0) {
+				sg->length += data_size;
+				i++;
+				break;
+			}
+		}
+		brq->data.sg_len = i;
+	}
+
+	mmc_queue_bounce_pre(mqrq);
+
+	mmc_pre_req(card->host, &brq->mrq);
+	mqrq->prepared = 1;
+
+}
+
+static void mmc_blk_prep_next(struct mmc_queue *mq, struct mmc_card *card)
+{
+	if (mmc_queue_fetch_next(mq))
+		mmc_blk_rw_rq_prep(mq->mqrq_next, card, 0, mq);
+}
+
+/* Undo mmc_blk_rw_rq_prep() for a request that won't be issued */
+static void mmc_blk_rw_rq_unprep(struct mmc_queue_req *mqrq,
+				 struct mmc_card *card)
+{
+	if (mqrq->prepared) {
+		mmc_post_req(card->host, &mqrq->brq.mrq, -EIO);
+		mqrq->prepared = 0;
+	}
+}
+
 static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 {
 	struct mmc_blk_data *md = mq->data;
 	struct mmc_card *card = md->queue.card;
-	struct mmc_blk_request brq;
+	struct mmc_queue_req *mqrq = mq->mqrq_cur;
+	struct mmc_blk_request *brq = &mqrq->brq;
+	DECLARE_COMPLETION_ONSTACK(done);
 	int ret = 1, disable_multi = 0, card_no_ready = 0;
 	int err = 0;
 	int try_recovery = 1, do_reinit = 0, do_remove = 0;
@@ -307,6 +446,7 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		if (err) {
 			if (mmc_card_sd(card))
 				remove_card(card->host);
+			mmc_blk_rw_rq_unprep(mqrq, card);
 			spin_lock_irq(&md->lock);
 			__blk_end_request_all(req, -EIO);
 			spin_unlock_irq(&md->lock);
@@ -357,6 +497,7 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 
 	if (mmc_bus_fails_resume(card->host) || card_no_ready ||
 		!retries) {
+		mmc_blk_rw_rq_unprep(mqrq, card);
 		spin_lock_irq(&md->lock);
 		__blk_end_request_all(req, -EIO);
 		spin_unlock_irq(&md->lock);
@@ -369,133 +510,34 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 
 	do {
 		struct mmc_command cmd;
-		u32 readcmd, writecmd, status = 0;
-
-		memset(&brq, 0, sizeof(struct mmc_blk_request));
-		brq.mrq.cmd = &brq.cmd;
-		brq.mrq.data = &brq.data;
-
-		brq.cmd.arg = blk_rq_pos(req);
-		if (!mmc_card_blockaddr(card))
-			brq.cmd.arg <<= 9;
-		brq.cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-		brq.data.blksz = 512;
-		brq.stop.opcode = MMC_STOP_TRANSMISSION;
-		brq.stop.arg = 0;
-		brq.stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-		brq.data.blocks = blk_rq_sectors(req);
-
-		/*
-		 * The block layer doesn't support all sector count
-		 * restrictions, so we need to be prepared for too big
-		 * requests.
-		 */
-		if (brq.data.blocks > card->host->max_blk_count)
-			brq.data.blocks = card->host->max_blk_count;
+		u32 status = 0;
 
-		/*
-		 * After a read error, we redo the request one sector at a time
-		 * in order to accurately determine which sectors can be read
-		 * successfully.
-		 */
-		if (disable_multi && brq.data.blocks > 1)
-			brq.data.blocks = 1;
-
-		if (brq.data.blocks > 1) {
-			/* SPI multiblock writes terminate using a special
-			 * token, not a STOP_TRANSMISSION request.
-			 */
-			if (!mmc_host_is_spi(card->host)
-					|| rq_data_dir(req) == READ)
-				brq.mrq.stop = &brq.stop;
-			readcmd = MMC_READ_MULTIPLE_BLOCK;
-			writecmd = MMC_WRITE_MULTIPLE_BLOCK;
-		} else {
-			brq.mrq.stop = NULL;
-			readcmd = MMC_READ_SINGLE_BLOCK;
-			writecmd = MMC_WRITE_BLOCK;
-		}
+		if (!mqrq->prepared)
+			mmc_blk_rw_rq_prep(mqrq, card, disable_multi, mq);
+		mqrq->prepared = 0;
 
-		if (rq_data_dir(req) == READ) {
-			brq.cmd.opcode = readcmd;
-			brq.data.flags |= MMC_DATA_READ;
-		} else {
-			brq.cmd.opcode = writecmd;
-			brq.data.flags |= MMC_DATA_WRITE;
-
-#if defined(CONFIG_ARCH_MSM7X30)
-		if (board_emmc_boot())
-			if (mmc_card_mmc(card)) {
-				if (brq.cmd.arg < 131073) {/* should not write any value before 131073 */
-					pr_err("%s: pid %d(tgid %d)(%s)\n", __func__,
-						(unsigned)(current->pid), (unsigned)(current->tgid),
-						current->comm);
-					pr_err("ERROR! Attemp to write radio partition start %d size %d\n"
-						, brq.cmd.arg, blk_rq_sectors(req));
-					BUG();
-
-					return 0;
-				}
-#if defined(CONFIG_ARCH_MSM7230)
-				if ((brq.cmd.arg > 143361) && (brq.cmd.arg < 163328)) {
-
-					pr_err("%s: pid %d(tgid %d)(%s)\n", __func__,
-						(unsigned)(current->pid), (unsigned)(current->tgid),
-						current->comm);
-					pr_err("ERROR! Attemp to write radio partition start %d size %d\n"
-						, brq.cmd.arg, blk_rq_sectors(req));
-					BUG();
-
-
-					return 0;
-				}
-#endif
-			}
-#endif
-		}
-
-		mmc_set_data_timeout(&brq.data, card);
-
-		brq.data.sg = mq->sg;
-		brq.data.sg_len = mmc_queue_map_sg(mq);
-
-		/*
-		 * Adjust the sg list so it is the same size as the
-		 * request.
-		 */
-		if (brq.data.blocks != blk_rq_sectors(req)) {
-			int i, data_size = brq.data.blocks << 9;
-			struct scatterlist *sg;
-
-			for_each_sg(brq.data.sg, sg, brq.data.sg_len, i) {
-				data_size -= sg->length;
-				if (data_size <= 0) {
-					sg->length += data_size;
-					i++;
-					break;
-				}
-			}
-			brq.data.sg_len = i;
-		}
+		mmc_start_req(card->host, &brq->mrq, &done);
 
-		mmc_queue_bounce_pre(mq);
+		/* Get the next request ready while this one is on the bus */
+		mmc_blk_prep_next(mq, card);
 
-		mmc_wait_for_req(card->host, &brq.mrq);
+		mmc_wait_for_req_done(&brq->mrq);
+		mmc_post_req(card->host, &brq->mrq, 0);
 
-		mmc_queue_bounce_post(mq);
+		mmc_queue_bounce_post(mqrq);
 
 		/*
 		 * Check for errors here, but don't jump to cmd_err
 		 * until later as we need to wait for the card to leave
 		 * programming mode even when things go wrong.
 		 */
-		if (brq.cmd.error || brq.data.error || brq.stop.error) {
-			if (brq.data.blocks > 1 && rq_data_dir(req) == READ) {
-				if (brq.cmd.error) {
+		if (brq->cmd.error || brq->data.error || brq->stop.error) {
+			if (brq->data.blocks > 1 && rq_data_dir(req) == READ) {
+				if (brq->cmd.error) {
 					printk(KERN_ERR "%s: error %d sending read "
 						"command, response %#x\n",
-						req->rq_disk->disk_name, brq.cmd.error,
-						brq.cmd.resp[0]);
+						req->rq_disk->disk_name, brq->cmd.error,
+						brq->cmd.resp[0]);
 				}
 				/* Redo read one sector at a time */
 				printk(KERN_WARNING "%s: retrying using single "
@@ -508,29 +550,29 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 			disable_multi = 0;
 		}
 
-		if (brq.cmd.error) {
+		if (brq->cmd.error) {
 			printk(KERN_ERR "%s: error %d sending read/write "
 			       "command, response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.cmd.error,
-			       brq.cmd.resp[0], status);
+			       req->rq_disk->disk_name, brq->cmd.error,
+			       brq->cmd.resp[0], status);
 		}
 
-		if (brq.data.error) {
-			if (brq.data.error == -ETIMEDOUT && brq.mrq.stop)
+		if (brq->data.error) {
+			if (brq->data.error == -ETIMEDOUT && brq->mrq.stop)
 				/* 'Stop' response contains card status */
-				status = brq.mrq.stop->resp[0];
+				status = brq->mrq.stop->resp[0];
 			printk(KERN_ERR "%s: error %d transferring data,"
 			       " sector %u, nr %u, card status %#x\n",
-			       req->rq_disk->disk_name, brq.data.error,
+			       req->rq_disk->disk_name, brq->data.error,
 			       (unsigned)blk_rq_pos(req),
 			       (unsigned)blk_rq_sectors(req), status);
 		}
 
-		if (brq.stop.error) {
+		if (brq->stop.error) {
 			printk(KERN_ERR "%s: error %d sending stop command, "
 			       "response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.stop.error,
-			       brq.stop.resp[0], status);
+			       req->rq_disk->disk_name, brq->stop.error,
+			       brq->stop.resp[0], status);
 		}
 
 		if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
@@ -624,8 +666,8 @@ recovery:
 			goto cmd_err;
 		}
 
-		if (brq.cmd.error || brq.stop.error ||
-			brq.data.error || card_no_ready) {
+		if (brq->cmd.error || brq->stop.error ||
+			brq->data.error || card_no_ready) {
 			if (try_recovery == 1)
 				do_reinit = 1;
 			else if (mmc_card_sd(card) && (try_recovery == 2))
@@ -640,7 +682,7 @@ recovery:
 				 * read a single sector.
 				 */
 				spin_lock_irq(&md->lock);
-				ret = __blk_end_request(req, -EIO, brq.data.blksz);
+				ret = __blk_end_request(req, -EIO, brq->data.blksz);
 				spin_unlock_irq(&md->lock);
 				continue;
 			}
@@ -651,7 +693,7 @@ recovery:
 		 * A block was successfully transferred.
 		 */
 		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
+		ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
 		spin_unlock_irq(&md->lock);
 	} while (ret);
 
@@ -679,7 +721,7 @@ recovery:
 		}
 	} else {
 		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
+		ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
 		spin_unlock_irq(&md->lock);
 	}
 
@@ -211,6 +211,74 @@ static void mmc_wait_done(struct mmc_request *mrq)
 	complete(mrq->done_data);
 }
 
+/**
+ *	mmc_pre_req - prepare a request's data ahead of issuing it
+ *	@host: MMC host the request will be issued on
+ *	@mrq: MMC request to prepare
+ *
+ *	Lets the host driver map the data for DMA and do the cache
+ *	maintenance while the host is still busy with another request.
+ *	Every prepared request must be passed to mmc_post_req() once it
+ *	has completed.
+ */
+void mmc_pre_req(struct mmc_host *host, struct mmc_request *mrq)
+{
+	if (mrq->data)
+		mrq->data->host_cookie = 0;
+	if (mrq->data && host->ops->pre_req)
+		host->ops->pre_req(host, mrq);
+}
+
+EXPORT_SYMBOL(mmc_pre_req);
+
+/**
+ *	mmc_post_req - undo mmc_pre_req() for a finished request
+ *	@host: MMC host the request was issued on
+ *	@mrq: MMC request that was prepared
+ *	@err: non-zero if the request was never issued or failed
+ */
+void mmc_post_req(struct mmc_host *host, struct mmc_request *mrq, int err)
+{
+	if (mrq->data && host->ops->post_req)
+		host->ops->post_req(host, mrq, err);
+	if (mrq->data)
+		mrq->data->host_cookie = 0;
+}
+
+EXPORT_SYMBOL(mmc_post_req);
+
+/**
+ *	mmc_start_req - start a request without waiting for it
+ *	@host: MMC host to start the request
+ *	@mrq: MMC request to start
+ *	@done: completion to signal when the request has finished
+ *
+ *	The caller may prepare further work and must then wait with
+ *	mmc_wait_for_req_done() before looking at the results.
+ */
+void mmc_start_req(struct mmc_host *host, struct mmc_request *mrq,
+		   struct completion *done)
+{
+	init_completion(done);
+	mrq->done_data = done;
+	mrq->done = mmc_wait_done;
+
+	mmc_start_request(host, mrq);
+}
+
+EXPORT_SYMBOL(mmc_start_req);
+
+/**
+ *	mmc_wait_for_req_done - wait for a request started by mmc_start_req
+ *	@mrq: MMC request to wait for
+ */
+void mmc_wait_for_req_done(struct mmc_request *mrq)
+{
+	wait_for_completion(mrq->done_data);
+}
+
+EXPORT_SYMBOL(mmc_wait_for_req_done);
+
 struct msmsdcc_host;
 void msmsdcc_request_end(struct msmsdcc_host *host, struct mmc_request *mrq);
 void msmsdcc_stop_data(struct msmsdcc_host *host);
@@ -236,6 +304,10 @@ void mmc_wait_for_req(struct mmc_host *host, struct mmc_request *mrq)
 	mrq->done_data = &complete;
 	mrq->done = mmc_wait_done;
 
+	/* Not prepared with mmc_pre_req(), whatever the caller left here */
+	if (mrq->data)
+		mrq->data->host_cookie = 0;
+
 	mmc_start_request(host, mrq);
 
 #ifdef CONFIG_WIMAX
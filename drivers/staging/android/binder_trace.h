@@ -0,0 +1,178 @@
+/*
+ * Tracepoints for the binder driver
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(binder_transaction,
+
+	TP_PROTO(int reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+
+	TP_ARGS(reply, t, target_node),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id		)
+		__field(	int,		target_node		)
+		__field(	int,		to_proc			)
+		__field(	int,		to_thread		)
+		__field(	int,		reply			)
+		__field(	unsigned int,	code			)
+		__field(	unsigned int,	flags			)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->target_node	= target_node ? target_node->debug_id : 0;
+		__entry->to_proc	= t->to_proc->pid;
+		__entry->to_thread	= t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply		= reply;
+		__entry->code		= t->code;
+		__entry->flags		= t->flags;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(struct binder_transaction *t, s64 queued_us),
+
+	TP_ARGS(t, queued_us),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id		)
+		__field(	s64,		queued_us		)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->queued_us	= queued_us;
+	),
+
+	TP_printk("transaction=%d queued=%lldus",
+		  __entry->debug_id, (long long)__entry->queued_us)
+);
+
+TRACE_EVENT(binder_wait_for_work,
+
+	TP_PROTO(int proc_work, int transaction_stack, int thread_todo),
+
+	TP_ARGS(proc_work, transaction_stack, thread_todo),
+
+	TP_STRUCT__entry(
+		__field(	int,		proc_work		)
+		__field(	int,		transaction_stack	)
+		__field(	int,		thread_todo		)
+	),
+
+	TP_fast_assign(
+		__entry->proc_work		= proc_work;
+		__entry->transaction_stack	= transaction_stack;
+		__entry->thread_todo		= thread_todo;
+	),
+
+	TP_printk("proc_work=%d transaction_stack=%d thread_todo=%d",
+		  __entry->proc_work, __entry->transaction_stack,
+		  __entry->thread_todo)
+);
+
+TRACE_EVENT(binder_read_done,
+
+	TP_PROTO(int ret),
+
+	TP_ARGS(ret),
+
+	TP_STRUCT__entry(
+		__field(	int,		ret			)
+	),
+
+	TP_fast_assign(
+		__entry->ret = ret;
+	),
+
+	TP_printk("ret=%d", __entry->ret)
+);
+
+TRACE_EVENT(binder_alloc_buf,
+
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf,
+		 size_t data_size, size_t offsets_size, int is_async),
+
+	TP_ARGS(proc, buf, data_size, offsets_size, is_async),
+
+	TP_STRUCT__entry(
+		__field(	int,		proc			)
+		__field(	void *,		buffer			)
+		__field(	size_t,		data_size		)
+		__field(	size_t,		offsets_size		)
+		__field(	int,		is_async		)
+	),
+
+	TP_fast_assign(
+		__entry->proc		= proc->pid;
+		__entry->buffer		= buf;
+		__entry->data_size	= data_size;
+		__entry->offsets_size	= offsets_size;
+		__entry->is_async	= is_async;
+	),
+
+	TP_printk("proc=%d buffer=%p size=%zd-%zd async=%d",
+		  __entry->proc, __entry->buffer, __entry->data_size,
+		  __entry->offsets_size, __entry->is_async)
+);
+
+TRACE_EVENT(binder_free_buf,
+
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+
+	TP_ARGS(proc, buf),
+
+	TP_STRUCT__entry(
+		__field(	int,		proc			)
+		__field(	int,		debug_id		)
+		__field(	void *,		buffer			)
+		__field(	size_t,		data_size		)
+		__field(	size_t,		offsets_size		)
+	),
+
+	TP_fast_assign(
+		__entry->proc		= proc->pid;
+		__entry->debug_id	= buf->debug_id;
+		__entry->buffer		= buf;
+		__entry->data_size	= buf->data_size;
+		__entry->offsets_size	= buf->offsets_size;
+	),
+
+	TP_printk("proc=%d transaction=%d buffer=%p size=%zd-%zd",
+		  __entry->proc, __entry->debug_id, __entry->buffer,
+		  __entry->data_size, __entry->offsets_size)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
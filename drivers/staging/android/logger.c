@@ -21,10 +21,14 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mutex.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/workqueue.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -34,31 +38,95 @@
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock'. Nothing that can sleep or fault, such as copying from or
+ * to user-space, is done while holding it: writers stage their entry in
+ * kernel memory first and readers copy an entry out before returning it.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct list_head	chunks;	/* archived chunks, oldest first */
+	unsigned long		next_seq; /* sequence number of next chunk */
+	struct work_struct	seal_work; /* moves old entries into chunks */
+	unsigned long		seal_gen; /* bumped when entries are dropped */
+	size_t			archive_size; /* compressed bytes in chunks */
+	size_t			archive_max; /* limit for archive_size */
+#endif
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned char		*entry;	/* entries being copied to user-space */
+	struct mutex		mutex;	/* serializes users of 'entry' */
+	int			batch;	/* read() returns as many entries as fit */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	int			in_archive; /* reading chunks, not the ring */
+	unsigned long		seq;	/* chunk being read */
+	size_t			c_off;	/* read offset within that chunk */
+	unsigned char		*chunk;	/* uncompressed copy of a chunk */
+	unsigned long		chunk_seq; /* which chunk 'chunk' holds */
+	size_t			chunk_len; /* and its length, 0 if none */
+#endif
 };
 
+/* payloads up to this size are staged on the writer's stack */
+#define LOGGER_STACK_PAYLOAD	256
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/*
+ * struct logger_chunk - a run of whole entries that was moved out of the
+ * ring to make room for new ones, compressed with LZO
+ *
+ * Chunks are protected by log->lock. Their sequence numbers are
+ * consecutive: only the oldest chunk is ever dropped. A reader that is
+ * decompressing a chunk holds a use on it, so that a chunk dropped in the
+ * meantime is only unlinked and freed once the reader is done with it.
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in logger_log's chunks */
+	unsigned long		seq;	/* sequence number */
+	int			users;	/* readers decompressing it */
+	size_t			len;	/* uncompressed length */
+	size_t			clen;	/* compressed length */
+	unsigned char		data[0]; /* compressed entries */
+};
+
+/* upper bound for the uncompressed length of a chunk */
+#define LOGGER_CHUNK_SIZE	(8*1024)
+
+/* the plain ring gets 1/4 of a log's memory, the archive the rest */
+#define LOGGER_RING_SHIFT	2
+
+/*
+ * the ring is sealed into chunks from a work item once it is more than
+ * half full, which leaves the other half for writes that come in before
+ * the work item gets to run
+ */
+#define logger_need_seal(log) \
+	(logger_offset((log)->w_off - (log)->head) > (log)->size / 2)
+
+/* compression buffers, shared by all logs and protected by logger_lzo_mutex */
+static DEFINE_MUTEX(logger_lzo_mutex);
+static void *logger_lzo_wrkmem;
+static unsigned char *logger_lzo_src;
+static unsigned char *logger_lzo_dst;
+#endif
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -89,7 +157,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,15 +176,15 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - reads exactly 'count' bytes from 'log' into 'buf' and
+ * advances the reader past them.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void do_read_log(struct logger_log *log,
+			struct logger_reader *reader,
+			unsigned char *buf,
+			size_t count)
 {
 	size_t len;
 
@@ -126,20 +194,385 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	memcpy(buf, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(buf + len, log->buffer, count - len);
 
 	reader->r_off = logger_offset(reader->r_off + count);
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/*
+ * logger_find_chunk - returns the archived chunk with sequence number 'seq'
+ *
+ * Caller must hold log->lock.
+ */
+static struct logger_chunk *logger_find_chunk(struct logger_log *log,
+					      unsigned long seq)
+{
+	struct logger_chunk *chunk;
+
+	list_for_each_entry(chunk, &log->chunks, list)
+		if (chunk->seq == seq)
+			return chunk;
+	return NULL;
+}
+
+/*
+ * logger_next_chunk - moves 'reader' to the start of the chunk following the
+ * one it is reading, or back to the ring after the newest chunk.
+ *
+ * Caller must hold log->lock.
+ */
+static void logger_next_chunk(struct logger_log *log,
+			      struct logger_reader *reader)
+{
+	if (reader->seq + 1 == log->next_seq) {
+		reader->in_archive = 0;
+		reader->r_off = log->head;
+	} else {
+		reader->seq++;
+		reader->c_off = 0;
+	}
+}
+
+/*
+ * logger_put_chunk - drops a use of 'chunk', freeing it if it has been
+ * dropped from the archive in the meantime
+ *
+ * Caller must hold log->lock.
+ */
+static void logger_put_chunk(struct logger_chunk *chunk)
+{
+	if (!--chunk->users && list_empty(&chunk->list))
+		kfree(chunk);
+}
+
+/*
+ * logger_lock_reader - takes log->lock, first making sure that
+ * reader->chunk holds the uncompressed copy of the chunk 'reader' is
+ * reading, if any. The chunk is decompressed with log->lock dropped; it is
+ * only held to find the chunk and pin it. A chunk that fails to decompress
+ * is skipped.
+ *
+ * Caller must hold reader->mutex.
+ */
+static void logger_lock_reader(struct logger_log *log,
+			       struct logger_reader *reader)
+{
+	spin_lock(&log->lock);
+	while (reader->in_archive && (!reader->chunk_len ||
+				      reader->chunk_seq != reader->seq)) {
+		struct logger_chunk *chunk;
+		size_t len = LOGGER_CHUNK_SIZE;
+		int ret;
+
+		chunk = logger_find_chunk(log, reader->seq);
+		BUG_ON(!chunk);
+		chunk->users++;
+		spin_unlock(&log->lock);
+
+		ret = lzo1x_decompress_safe(chunk->data, chunk->clen,
+					    reader->chunk, &len);
+
+		spin_lock(&log->lock);
+		if (unlikely(ret != LZO_E_OK || len != chunk->len)) {
+			printk(KERN_ERR "logger: failed to decompress chunk "
+			       "%lu of log '%s' (%d)\n", chunk->seq,
+			       log->misc.name, ret);
+			reader->chunk_len = 0;
+			if (reader->in_archive && reader->seq == chunk->seq)
+				logger_next_chunk(log, reader);
+		} else {
+			reader->chunk_seq = chunk->seq;
+			reader->chunk_len = len;
+		}
+		logger_put_chunk(chunk);
+	}
+}
+
+/*
+ * logger_drop_chunk - frees the oldest archived chunk, moving its readers
+ * to the start of the next one.
+ *
+ * Caller must hold log->lock.
+ */
+static void logger_drop_chunk(struct logger_log *log)
+{
+	struct logger_chunk *chunk;
+	struct logger_reader *reader;
+
+	chunk = list_first_entry(&log->chunks, struct logger_chunk, list);
+	list_for_each_entry(reader, &log->readers, list)
+		if (reader->in_archive && reader->seq == chunk->seq)
+			logger_next_chunk(log, reader);
+	list_del_init(&chunk->list);
+	log->archive_size -= chunk->clen;
+	if (!chunk->users)
+		kfree(chunk);
+}
+
+/*
+ * logger_seal_chunk - moves the oldest entries of the ring, up to
+ * LOGGER_CHUNK_SIZE bytes but at least one entry, into a compressed chunk
+ * and advances log->head past them. Readers positioned within those
+ * entries follow them into the archive.
+ *
+ * The entries are copied out under log->lock, but compressed and the chunk
+ * allocated without it. If a writer had to drop entries at log->head in
+ * the meantime, the chunk is stale and is thrown away.
+ *
+ * Returns nonzero if it should be called again.
+ *
+ * Caller must hold logger_lzo_mutex.
+ */
+static int logger_seal_chunk(struct logger_log *log)
+{
+	struct logger_chunk *chunk;
+	struct logger_reader *reader;
+	unsigned long gen;
+	size_t start, off, part;
+	size_t len = 0;
+	size_t clen;
+
+	spin_lock(&log->lock);
+	if (!logger_need_seal(log)) {
+		spin_unlock(&log->lock);
+		return 0;
+	}
+
+	start = off = log->head;
+	do {
+		size_t nr = get_entry_len(log, off);
+
+		if (len && len + nr > LOGGER_CHUNK_SIZE)
+			break;
+		off = logger_offset(off + nr);
+		len += nr;
+	} while (off != log->w_off);
+
+	part = min(len, log->size - start);
+	memcpy(logger_lzo_src, log->buffer + start, part);
+	if (len != part)
+		memcpy(logger_lzo_src + part, log->buffer, len - part);
+	gen = log->seal_gen;
+	spin_unlock(&log->lock);
+
+	if (lzo1x_1_compress(logger_lzo_src, len, logger_lzo_dst, &clen,
+			     logger_lzo_wrkmem) != LZO_E_OK)
+		return 0;
+	chunk = kmalloc(sizeof(*chunk) + clen, GFP_KERNEL);
+	if (!chunk)
+		return 0;
+	memcpy(chunk->data, logger_lzo_dst, clen);
+	chunk->len = len;
+	chunk->clen = clen;
+	chunk->users = 0;
+
+	spin_lock(&log->lock);
+	if (unlikely(log->seal_gen != gen)) {
+		spin_unlock(&log->lock);
+		kfree(chunk);
+		return 1;
+	}
+
+	chunk->seq = log->next_seq++;
+	list_add_tail(&chunk->list, &log->chunks);
+	log->archive_size += clen;
+
+	list_for_each_entry(reader, &log->readers, list) {
+		size_t pos = logger_offset(reader->r_off - start);
+
+		if (reader->in_archive || pos >= len)
+			continue;
+		reader->in_archive = 1;
+		reader->seq = chunk->seq;
+		reader->c_off = pos;
+	}
+	log->head = off;
+
+	while (log->archive_size > log->archive_max)
+		logger_drop_chunk(log);
+	spin_unlock(&log->lock);
+
+	return 1;
+}
+
+/*
+ * logger_seal_work - seals chunks until the ring is at most half full
+ */
+static void logger_seal_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      seal_work);
+
+	mutex_lock(&logger_lzo_mutex);
+	while (logger_seal_chunk(log))
+		;
+	mutex_unlock(&logger_lzo_mutex);
+}
+
+/*
+ * logger_flush_archive - frees all archived chunks
+ *
+ * Caller must hold log->lock.
+ */
+static void logger_flush_archive(struct logger_log *log)
+{
+	struct logger_reader *reader;
+
+	list_for_each_entry(reader, &log->readers, list)
+		reader->in_archive = 0;
+	while (!list_empty(&log->chunks))
+		logger_drop_chunk(log);
+	log->seal_gen++;
+}
+#else
+static inline void logger_lock_reader(struct logger_log *log,
+				      struct logger_reader *reader)
+{
+	spin_lock(&log->lock);
+}
+#endif
+
+/*
+ * logger_readable - does 'reader' have anything left to read?
+ *
+ * Caller must hold log->lock.
+ */
+static inline int logger_readable(struct logger_log *log,
+				  struct logger_reader *reader)
+{
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	if (reader->in_archive)
+		return 1;
+#endif
+	return log->w_off != reader->r_off;
+}
+
+/*
+ * logger_next_entry_len - returns the length of the next entry for
+ * 'reader', or zero if there is none. Zero is also returned if the reader
+ * moved on to a chunk that logger_lock_reader() has not decompressed yet.
+ *
+ * Caller must hold log->lock and reader->mutex.
+ */
+static size_t logger_next_entry_len(struct logger_log *log,
+				    struct logger_reader *reader)
+{
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	if (reader->in_archive) {
+		__u16 val;
+
+		if (!reader->chunk_len || reader->chunk_seq != reader->seq)
+			return 0;
+		memcpy(&val, reader->chunk + reader->c_off, 2);
+		return sizeof(struct logger_entry) + val;
+	}
+#endif
+	if (log->w_off == reader->r_off)
+		return 0;
+	return get_entry_len(log, reader->r_off);
+}
+
+/*
+ * logger_read_entry - reads the next entry, 'count' bytes long, for
+ * 'reader' into 'buf' and advances the reader past it.
+ *
+ * Caller must hold log->lock and reader->mutex, and must have called
+ * logger_next_entry_len() first.
+ */
+static void logger_read_entry(struct logger_log *log,
+			      struct logger_reader *reader,
+			      unsigned char *buf,
+			      size_t count)
+{
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	if (reader->in_archive) {
+		memcpy(buf, reader->chunk + reader->c_off, count);
+		reader->c_off += count;
+		if (reader->c_off >= reader->chunk_len)
+			logger_next_chunk(log, reader);
+		return;
+	}
+#endif
+	do_read_log(log, reader, buf, count);
+}
+
+/*
+ * logger_unread_len - returns how many bytes 'reader' has left to read, as
+ * they were written.
+ *
+ * Caller must hold log->lock.
+ */
+static size_t logger_unread_len(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	size_t r_off = reader->r_off;
+	size_t len = 0;
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	if (reader->in_archive) {
+		struct logger_chunk *chunk;
+
+		list_for_each_entry(chunk, &log->chunks, list)
+			if (chunk->seq >= reader->seq)
+				len += chunk->len;
+		len -= reader->c_off;
+		r_off = log->head;
+	}
+#endif
+	if (log->w_off >= r_off)
+		len += log->w_off - r_off;
+	else
+		len += (log->size - r_off) + log->w_off;
+	return len;
+}
+
+/*
+ * do_read_log_batch - reads as many whole entries as fit in 'count' bytes
+ * into the user-space buffer 'buf'. The entries are staged through the
+ * reader's entry buffer, LOGGER_ENTRY_MAX_LEN bytes at a time.
+ *
+ * Returns the number of bytes read, zero if the log was empty or the next
+ * entry did not fit, or a negative error code.
+ */
+static ssize_t do_read_log_batch(struct logger_log *log,
+				 struct logger_reader *reader,
+				 char __user *buf,
+				 size_t count)
+{
+	ssize_t done = 0;
+
+	while (1) {
+		size_t len = 0;
+
+		logger_lock_reader(log, reader);
+		while (1) {
+			size_t entry_len = logger_next_entry_len(log, reader);
+
+			if (!entry_len || done + len + entry_len > count ||
+			    len + entry_len > LOGGER_ENTRY_MAX_LEN)
+				break;
+			logger_read_entry(log, reader, reader->entry + len,
+					  entry_len);
+			len += entry_len;
+		}
+		spin_unlock(&log->lock);
 
-	return count;
+		if (!len)
+			break;
+		if (copy_to_user(buf + done, reader->entry, len))
+			return done ? done : -EFAULT;
+		done += len;
+	}
+
+	return done;
 }
 
 /*
@@ -149,7 +582,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or, after
+ * 	  LOGGER_SET_BATCH_READ, as many whole entries as fit in 'buf'
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -166,9 +600,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = !logger_readable(log, reader);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -189,26 +623,49 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+	logger_lock_reader(log, reader);
+
+	/* get the size of the next entry */
+	ret = logger_next_entry_len(log, reader);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(!ret)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
+		spin_unlock(&log->lock);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (reader->batch) {
+		spin_unlock(&log->lock);
+		ret = do_read_log_batch(log, reader, buf, count);
+		mutex_unlock(&reader->mutex);
+		/* lapped by a writer in between, try again */
+		if (unlikely(!ret))
+			goto start;
+		return ret;
+	}
+
+	/*
+	 * Get exactly one entry from the log. It is copied out under the
+	 * lock so that a writer lapping us cannot tear it, and handed to
+	 * user-space after the lock is dropped.
+	 */
+	logger_read_entry(log, reader, reader->entry, ret);
+
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(buf, reader->entry, ret))
+		ret = -EFAULT;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -217,7 +674,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -255,7 +712,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -263,18 +720,32 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
+	if (clock_interval(old, new, log->head)) {
 		log->head = get_next_entry(log, log->head, len);
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		/*
+		 * The seal work did not keep up and these entries are lost;
+		 * a chunk it is compressing from them must not be archived.
+		 */
+		log->seal_gen++;
+#endif
+	}
 
-	list_for_each_entry(reader, &log->readers, list)
+	list_for_each_entry(reader, &log->readers, list) {
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		/* r_off is not used while reading the archive */
+		if (reader->in_archive)
+			continue;
+#endif
 		if (clock_interval(old, new, reader->r_off))
 			reader->r_off = get_next_entry(log, reader->r_off, len);
+	}
 }
 
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -290,44 +761,26 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 
 }
 
-/*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
- */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
-{
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
-
-	log->w_off = logger_offset(log->w_off + count);
-
-	return count;
-}
-
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The whole entry is gathered from user-space, one copy per iovec, before
+ * log->lock is taken, so a writer that faults or sleeps never holds up the
+ * other writers or the readers; the lock only covers pulling readers
+ * forward and a single copy of the entry into the ring.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	unsigned char stack_entry[sizeof(struct logger_entry) +
+				  LOGGER_STACK_PAYLOAD];
+	unsigned char *entry = stack_entry;
+	unsigned char *payload;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -342,42 +795,56 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	if (header.len > LOGGER_STACK_PAYLOAD) {
+		entry = kmalloc(sizeof(struct logger_entry) + header.len,
+				GFP_KERNEL);
+		if (unlikely(!entry))
+			return -ENOMEM;
+	}
+	memcpy(entry, &header, sizeof(struct logger_entry));
+	payload = entry + sizeof(struct logger_entry);
 
-	while (nr_segs-- > 0) {
+	while (nr_segs-- > 0 && ret < header.len) {
 		size_t len;
-		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		/* stage this segment's payload */
+		if (unlikely(len && copy_from_user(payload + ret,
+						   iov->iov_base, len))) {
+			ret = -EFAULT;
+			goto out;
 		}
 
 		iov++;
-		ret += nr;
+		ret += len;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_lock(&log->lock);
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset.
+	 */
+	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+
+	do_write_log(log, entry, sizeof(struct logger_entry) + header.len);
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	if (logger_lzo_wrkmem && logger_need_seal(log))
+		schedule_work(&log->seal_work);
+#endif
+
+	spin_unlock(&log->lock);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
+out:
+	if (entry != stack_entry)
+		kfree(entry);
+
 	return ret;
 }
 
@@ -408,13 +875,39 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->entry = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->entry) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		reader->chunk = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		if (!reader->chunk) {
+			kfree(reader->entry);
+			kfree(reader);
+			return -ENOMEM;
+		}
+		reader->chunk_len = 0;
+#endif
+
 		reader->log = log;
+		reader->batch = 0;
+		mutex_init(&reader->mutex);
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		reader->in_archive = !list_empty(&log->chunks);
+		if (reader->in_archive) {
+			reader->seq = list_first_entry(&log->chunks,
+					struct logger_chunk, list)->seq;
+			reader->c_off = 0;
+		}
+#endif
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -433,9 +926,13 @@ static int logger_release(struct inode *ignored, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
 		struct logger_log *log = reader->log;
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		kfree(reader->chunk);
+#endif
+		kfree(reader->entry);
 		kfree(reader);
 	}
 
@@ -465,10 +962,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (logger_readable(log, reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -479,11 +976,23 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	/* reading the next entry's length may need the reader's buffers */
+	if (file->f_mode & FMODE_READ) {
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		if (cmd == LOGGER_GET_NEXT_ENTRY_LEN)
+			logger_lock_reader(log, reader);
+		else
+			spin_lock(&log->lock);
+	} else
+		spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		ret += log->archive_max;
+#endif
 		break;
 	case LOGGER_GET_LOG_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -491,10 +1000,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = logger_unread_len(log, reader);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -502,16 +1008,25 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		ret = logger_next_entry_len(log, reader);
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		logger_flush_archive(log);
+#endif
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
@@ -519,7 +1034,12 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	if (file->f_mode & FMODE_READ) {
+		reader = file->private_data;
+		mutex_unlock(&reader->mutex);
+	}
 
 	return ret;
 }
@@ -538,8 +1058,32 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. With CONFIG_ANDROID_LOGGER_COMPRESS,
+ * 'SIZE' is split between the plain ring and the compressed archive, and
+ * the ring must still be greater than LOGGER_CHUNK_SIZE.
  */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
+static unsigned char _buf_ ## VAR[(SIZE) >> LOGGER_RING_SHIFT]; \
+static struct logger_log VAR = { \
+	.buffer = _buf_ ## VAR, \
+	.misc = { \
+		.minor = MISC_DYNAMIC_MINOR, \
+		.name = NAME, \
+		.fops = &logger_fops, \
+		.parent = NULL, \
+	}, \
+	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.readers = LIST_HEAD_INIT(VAR .readers), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.w_off = 0, \
+	.head = 0, \
+	.size = (SIZE) >> LOGGER_RING_SHIFT, \
+	.chunks = LIST_HEAD_INIT(VAR .chunks), \
+	.seal_work = __WORK_INITIALIZER(VAR .seal_work, logger_seal_work), \
+	.archive_max = (SIZE) - ((SIZE) >> LOGGER_RING_SHIFT), \
+};
+#else
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
 static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
@@ -552,11 +1096,12 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
+#endif
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
 DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
@@ -587,8 +1132,14 @@ static int __init init_log(struct logger_log *log)
 		return ret;
 	}
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	printk(KERN_INFO "logger: created %luK+%luK compressed log '%s'\n",
+	       (unsigned long) log->size >> 10,
+	       (unsigned long) log->archive_max >> 10, log->misc.name);
+#else
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
+#endif
 
 	return 0;
 }
@@ -597,6 +1148,21 @@ static int __init logger_init(void)
 {
 	int ret;
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	logger_lzo_wrkmem = kmalloc(LZO1X_1_MEM_COMPRESS, GFP_KERNEL);
+	logger_lzo_src = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+	logger_lzo_dst = kmalloc(lzo1x_worst_compress(LOGGER_CHUNK_SIZE),
+				 GFP_KERNEL);
+	if (!logger_lzo_wrkmem || !logger_lzo_src || !logger_lzo_dst) {
+		printk(KERN_ERR "logger: no memory for compression, "
+		       "old entries will be dropped\n");
+		kfree(logger_lzo_wrkmem);
+		kfree(logger_lzo_src);
+		kfree(logger_lzo_dst);
+		logger_lzo_wrkmem = NULL;
+	}
+#endif
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
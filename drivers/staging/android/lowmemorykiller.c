@@ -16,6 +16,17 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * With pressure_mode set, kills are also driven by reclaim efficiency:
+ * vmscan reports pages scanned and reclaimed, and once a window of
+ * pressure_window scanned pages is complete the share that could not be
+ * reclaimed gives the pressure level. At the medium and critical levels
+ * (pressure_medium and pressure_critical percent, or pressure_thrash major
+ * faults within a window) processes with an oom_adj of at least
+ * pressure_adj[0] or pressure_adj[1] are killed. The minfree table keeps
+ * applying as a fallback, and whichever of the two asks for the lower
+ * oom_adj wins. The current level can be read from /dev/lmk_pressure,
+ * which becomes readable when it changes.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +46,12 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/vmstat.h>
 
 #define DEBUG_LEVEL_DEATHPENDING 6
 
@@ -76,6 +93,314 @@ static uint32_t lowmem_check_filepages = 0;
 		}					\
 	} while (0)
 
+/*
+ * Every thread group leader sits on the bucket for its oom_adj, so the
+ * shrinker only has to look at the highest non-empty bucket instead of
+ * walking the whole task list. The lock nests inside tasklist_lock and
+ * siglock, hence the irqsave. The shrinker only takes references to tasks
+ * under it, LOWMEM_SCAN_BATCH at a time, and sizes them up after dropping
+ * it.
+ */
+#define LOWMEM_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_SCAN_BATCH	16
+
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+static int lowmem_buckets_ready;
+
+enum {
+	LOWMEM_PRESSURE_NONE,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+};
+
+static const char *lowmem_pressure_names[] = {
+	"none",
+	"medium",
+	"critical",
+};
+
+static uint32_t lowmem_pressure_mode;
+static uint32_t lowmem_pressure_window = 512;
+static uint32_t lowmem_pressure_medium = 60;
+static uint32_t lowmem_pressure_critical = 95;
+static uint32_t lowmem_pressure_thrash = 256;
+static int lowmem_pressure_adj[2] = {
+	12,
+	6,
+};
+static int lowmem_pressure_adj_size = 2;
+
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static unsigned long lowmem_win_scanned;
+static unsigned long lowmem_win_reclaimed;
+static unsigned long lowmem_win_majflt;
+static int lowmem_pressure_level;
+static unsigned int lowmem_pressure_pct;
+static unsigned long lowmem_pressure_faults;
+static unsigned long lowmem_pressure_expires;
+static unsigned int lowmem_pressure_seq;
+static unsigned long lowmem_kills;
+static unsigned long lowmem_pressure_kills;
+
+static unsigned long lowmem_majflt(void)
+{
+	unsigned long sum = 0;
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	int cpu;
+
+	for_each_online_cpu(cpu)
+		sum += per_cpu(vm_event_states, cpu).event[PGMAJFAULT];
+#endif
+	return sum;
+}
+
+/*
+ * Called by vmscan after each zone pass. Pressure is the share of
+ * scanned pages that could not be reclaimed over the last window.
+ */
+void lowmem_vmpressure(unsigned long scanned, unsigned long reclaimed)
+{
+	unsigned long faults;
+	unsigned int pct;
+	int level;
+
+	if (!lowmem_pressure_mode || !scanned)
+		return;
+
+	spin_lock(&lowmem_pressure_lock);
+	if (!lowmem_win_scanned)
+		lowmem_win_majflt = lowmem_majflt();
+	lowmem_win_scanned += scanned;
+	lowmem_win_reclaimed += reclaimed;
+	if (lowmem_win_scanned < lowmem_pressure_window) {
+		spin_unlock(&lowmem_pressure_lock);
+		return;
+	}
+
+	if (lowmem_win_reclaimed >= lowmem_win_scanned)
+		pct = 0;
+	else
+		pct = 100 - lowmem_win_reclaimed * 100 / lowmem_win_scanned;
+	faults = lowmem_majflt() - lowmem_win_majflt;
+	lowmem_win_scanned = 0;
+	lowmem_win_reclaimed = 0;
+
+	if (pct >= lowmem_pressure_critical)
+		level = LOWMEM_PRESSURE_CRITICAL;
+	else if (pct >= lowmem_pressure_medium ||
+		 faults >= lowmem_pressure_thrash)
+		level = LOWMEM_PRESSURE_MEDIUM;
+	else
+		level = LOWMEM_PRESSURE_NONE;
+
+	lowmem_pressure_pct = pct;
+	lowmem_pressure_faults = faults;
+	lowmem_pressure_expires = jiffies + HZ;
+	if (level != lowmem_pressure_level) {
+		lowmem_pressure_level = level;
+		lowmem_pressure_seq++;
+		spin_unlock(&lowmem_pressure_lock);
+		lowmem_print(3, "pressure %s, %u%%, %lu faults\n",
+			     lowmem_pressure_names[level], pct, faults);
+		wake_up_interruptible(&lowmem_pressure_wait);
+		return;
+	}
+	spin_unlock(&lowmem_pressure_lock);
+}
+
+/* A level is only trusted for a second after the window that set it. */
+static int lowmem_get_pressure(void)
+{
+	int level;
+
+	spin_lock(&lowmem_pressure_lock);
+	level = lowmem_pressure_level;
+	if (level != LOWMEM_PRESSURE_NONE &&
+	    time_after(jiffies, lowmem_pressure_expires)) {
+		level = LOWMEM_PRESSURE_NONE;
+		lowmem_pressure_level = level;
+		lowmem_pressure_seq++;
+		spin_unlock(&lowmem_pressure_lock);
+		wake_up_interruptible(&lowmem_pressure_wait);
+		return level;
+	}
+	spin_unlock(&lowmem_pressure_lock);
+	return level;
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(unsigned long)lowmem_pressure_seq;
+	return nonseekable_open(inode, file);
+}
+
+/*
+ * Each read returns the current level, pressure, major faults in the
+ * last window and the kill counts, and re-arms poll(). Once the line has
+ * been read, reads return 0 until the level changes, so cat stops and a
+ * poll() loop gets the new line from the start.
+ */
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	char tmp[96];
+	unsigned int seq;
+	int len;
+
+	lowmem_get_pressure();
+
+	spin_lock(&lowmem_pressure_lock);
+	seq = lowmem_pressure_seq;
+	len = snprintf(tmp, sizeof(tmp), "%s %u %lu %lu %lu\n",
+		       lowmem_pressure_names[lowmem_pressure_level],
+		       lowmem_pressure_pct, lowmem_pressure_faults,
+		       lowmem_kills, lowmem_pressure_kills);
+	spin_unlock(&lowmem_pressure_lock);
+
+	if ((unsigned long)file->private_data != seq)
+		*pos = 0;
+	file->private_data = (void *)(unsigned long)seq;
+	return simple_read_from_buffer(buf, count, pos, tmp, len);
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+
+	if ((unsigned long)file->private_data != lowmem_pressure_seq)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lmk_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
+static inline struct list_head *lowmem_bucket(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
+void lowmem_adj_add(struct task_struct *task)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	if (lowmem_buckets_ready)
+		list_add_tail(&task->oom_adj_node,
+			      lowmem_bucket(task->signal->oom_adj));
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+void lowmem_adj_del(struct task_struct *task)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	if (lowmem_buckets_ready)
+		list_del_init(&task->oom_adj_node);
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+void lowmem_adj_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	if (lowmem_buckets_ready) {
+		list_del_init(&old->oom_adj_node);
+		list_add_tail(&new->oom_adj_node,
+			      lowmem_bucket(new->signal->oom_adj));
+	}
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+/* Called with the task's siglock held after its oom_adj changed. */
+void lowmem_adj_update(struct task_struct *task)
+{
+	struct task_struct *leader = task->group_leader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	/*
+	 * A racing exec may have just handed the leader role to another
+	 * thread; the shrinker re-files any task found in the wrong bucket.
+	 */
+	if (lowmem_buckets_ready && !list_empty(&leader->oom_adj_node))
+		list_move_tail(&leader->oom_adj_node,
+			       lowmem_bucket(leader->signal->oom_adj));
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+/*
+ * lowmem_grab_bucket - takes a reference to up to LOWMEM_SCAN_BATCH tasks
+ * from the front of the bucket for 'bucket_adj' and rotates them to its
+ * tail, so that the next call returns the tasks after them. '*left' must
+ * be negative on the first call for a bucket; it is set to the number of
+ * tasks still to be returned.
+ *
+ * Tasks whose oom_adj changed are moved to their new bucket. If one moved
+ * to a higher bucket, which has already been scanned, its oom_adj is
+ * returned in '*moved_up'.
+ *
+ * Returns the number of tasks in 'tasks'.
+ */
+static int lowmem_grab_bucket(int bucket_adj, struct task_struct **tasks,
+			      int *left, int *moved_up)
+{
+	struct list_head *bucket = lowmem_bucket(bucket_adj);
+	struct task_struct *p, *n;
+	unsigned long flags;
+	int first = *left < 0;
+	int want = first ? LOWMEM_SCAN_BATCH :
+			   min(*left, LOWMEM_SCAN_BATCH);
+	int count = 0;
+	int nr = 0;
+	int i;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	list_for_each_entry_safe(p, n, bucket, oom_adj_node) {
+		int oom_adj = p->signal->oom_adj;
+
+		if (oom_adj != bucket_adj) {
+			list_move_tail(&p->oom_adj_node,
+				       lowmem_bucket(oom_adj));
+			if (oom_adj > *moved_up)
+				*moved_up = oom_adj;
+			continue;
+		}
+
+		count++;
+		if (nr < want) {
+			get_task_struct(p);
+			tasks[nr++] = p;
+		} else if (!first)
+			break;
+	}
+	for (i = 0; i < nr; i++)
+		list_move_tail(&tasks[i]->oom_adj_node, bucket);
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+
+	*left = (first ? count : *left) - nr;
+	return nr;
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -135,7 +460,7 @@ static void dump_deathpending(struct task_struct *t_deathpending)
 
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
-	struct task_struct *p;
+	struct task_struct *tasks[LOWMEM_SCAN_BATCH];
 	struct task_struct *selected = NULL;
 	int rem = 0;
 	int tasksize;
@@ -143,6 +468,10 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
+	int bucket_adj;
+	int level = LOWMEM_PRESSURE_NONE;
+	int pressure_adj = OOM_ADJUST_MAX + 1;
+	int pressure_kill = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -167,6 +496,16 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+	if (lowmem_pressure_mode) {
+		/*
+		 * Reclaim efficiency can ask for a kill the minfree table
+		 * would not make yet; the table still applies as well.
+		 */
+		level = lowmem_get_pressure();
+		if (level > LOWMEM_PRESSURE_NONE &&
+		    level - 1 < lowmem_pressure_adj_size)
+			pressure_adj = lowmem_pressure_adj[level - 1];
+	}
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i]) {
 			if (other_file < lowmem_minfree[i] ||
@@ -178,10 +517,14 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			}
 		}
 	}
+	if (pressure_adj < min_adj) {
+		min_adj = pressure_adj;
+		pressure_kill = 1;
+	}
 	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
-			     nr_to_scan, gfp_mask, other_free, other_file,
-			     min_adj);
+		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d, "
+			     "level %d\n", nr_to_scan, gfp_mask, other_free,
+			     other_file, min_adj, level);
 	rem = global_page_state(NR_ACTIVE_ANON) +
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
@@ -193,53 +536,83 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	}
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
+	/*
+	 * Only the highest bucket holding a task with memory matters; the
+	 * mm's RSS counters are already an O(1) size estimate.
+	 */
+	for (bucket_adj = OOM_ADJUST_MAX;
+	     !selected && bucket_adj >= max(min_adj, OOM_DISABLE);
+	     bucket_adj--) {
+		int left = -1;
 
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+		do {
+			int moved_up = bucket_adj;
+			int nr;
+
+			nr = lowmem_grab_bucket(bucket_adj, tasks, &left,
+						&moved_up);
+			if (moved_up > bucket_adj) {
+				/*
+				 * A task's oom_adj was raised past this
+				 * bucket; it beats anything found here, so
+				 * scan again from its new bucket.
+				 */
+				for (i = 0; i < nr; i++)
+					put_task_struct(tasks[i]);
+				if (selected) {
+					put_task_struct(selected);
+					selected = NULL;
+				}
+				bucket_adj = moved_up + 1;
+				break;
+			}
+
+			for (i = 0; i < nr; i++) {
+				struct task_struct *p = tasks[i];
+				struct mm_struct *mm;
+
+				task_lock(p);
+				mm = p->mm;
+				tasksize = mm ? get_mm_rss(mm) : 0;
+				task_unlock(p);
+				if (tasksize <= 0 ||
+				    (selected && tasksize <= selected_tasksize)) {
+					put_task_struct(p);
+					continue;
+				}
+				if (selected)
+					put_task_struct(selected);
+				selected = p;
+				selected_tasksize = tasksize;
+				selected_oom_adj = bucket_adj;
+				lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+					     p->pid, p->comm, bucket_adj, tasksize);
+			}
+		} while (left > 0);
 	}
-	if (selected) {
+
+	/*
+	 * The reference only pins the task_struct; send_sig() takes the
+	 * sighand lock and fails if the victim has been reaped meanwhile,
+	 * where force_sig() would dereference its freed sighand.
+	 */
+	if (selected && !send_sig(SIGKILL, selected, 0)) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		spin_lock(&lowmem_pressure_lock);
+		lowmem_kills++;
+		if (pressure_kill)
+			lowmem_pressure_kills++;
+		spin_unlock(&lowmem_pressure_lock);
 		rem -= selected_tasksize;
 	}
+	if (selected)
+		put_task_struct(selected);
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -248,8 +621,36 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static void __init lowmem_init_buckets(void)
+{
+	struct task_struct *p;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
+	read_lock(&tasklist_lock);
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	for_each_process(p)
+		list_add_tail(&p->oom_adj_node,
+			      lowmem_bucket(p->signal->oom_adj));
+	lowmem_buckets_ready = 1;
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+	read_unlock(&tasklist_lock);
+}
+
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	lowmem_init_buckets();
+	ret = misc_register(&lowmem_pressure_misc);
+	if (unlikely(ret)) {
+		printk(KERN_ERR "lowmem: failed to register misc "
+		       "device for pressure!\n");
+		return ret;
+	}
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -258,6 +659,7 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	misc_deregister(&lowmem_pressure_misc);
 	task_free_unregister(&task_nb);
 }
 
@@ -273,6 +675,19 @@ module_param_named(check_filepages , lowmem_check_filepages, uint,
 module_param_array_named(minfile, lowmem_minfile, uint, &lowmem_minfile_size,
 			 S_IRUGO | S_IWUSR);
 
+module_param_named(pressure_mode, lowmem_pressure_mode, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_window, lowmem_pressure_window, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_thrash, lowmem_pressure_thrash, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(pressure_adj, lowmem_pressure_adj, int,
+			 &lowmem_pressure_adj_size, S_IRUGO | S_IWUSR);
+
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
@@ -23,8 +23,11 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
 #include <linux/lzo.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
@@ -38,6 +41,28 @@ static struct ramzswap *devices;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices;
+static unsigned int dedup;
+static unsigned int wb_interval = 30;
+static unsigned int wb_age = 4;
+static unsigned int wb_batch = 256;
+
+/* A page being written back to the backing device by the idle scanner */
+struct rzs_wb {
+	struct list_head list;
+	struct ramzswap *rzs;
+	struct page *page;	/* uncompressed copy being written */
+	u32 index;
+	int err;
+	ktime_t start;
+};
+
+/* Saved completion of a bio remapped to the backing device */
+struct rzs_remap {
+	struct ramzswap *rzs;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+	ktime_t start;
+};
 
 static int rzs_test_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
@@ -57,21 +82,196 @@ static void rzs_clear_flag(struct ramzswap *rzs, u32 index,
 	rzs->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+static struct hlist_head *dedup_bucket(struct ramzswap *rzs, u32 checksum)
+{
+	return &rzs->dedup_hash[checksum & (RZS_DEDUP_HASH_SIZE - 1)];
+}
+
+/*
+ * Look for a stored object with the same compressed contents as 'src'.
+ * On a hit the object gains a reference and slot 'index' points at it.
+ */
+static int ramzswap_dedup_get(struct ramzswap *rzs, u32 index,
+			const unsigned char *src, size_t clen, u32 checksum)
+{
+	struct rzs_dedup *entry;
+	struct hlist_node *pos;
+	unsigned char *cmem;
+	int found = 0;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(entry, pos, dedup_bucket(rzs, checksum), hash) {
+		if (entry->checksum != checksum || entry->clen != clen)
+			continue;
+
+		cmem = kmap_atomic(entry->page, KM_USER1) + entry->offset;
+		found = !memcmp(cmem + sizeof(struct zobj_header), src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		if (found) {
+			entry->refcount++;
+			rzs->table[index].page = entry->page;
+			rzs->table[index].offset = entry->offset;
+			rzs_set_flag(rzs, index, RZS_DEDUP);
+			break;
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	return found;
+}
+
+/*
+ * Index the object at <page, offset> just stored for slot 'index'.
+ * Failing to allocate the entry is harmless; the object is simply not
+ * shared.
+ */
+static void ramzswap_dedup_add(struct ramzswap *rzs, u32 index,
+			struct page *page, u32 offset, size_t clen, u32 checksum)
+{
+	struct rzs_dedup *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return;
+
+	entry->page = page;
+	entry->offset = offset;
+	entry->clen = clen;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_add_head(&entry->hash, dedup_bucket(rzs, checksum));
+	spin_unlock(&rzs->dedup_lock);
+
+	rzs_set_flag(rzs, index, RZS_DEDUP);
+}
+
+/*
+ * Find the index entry of the object at <page, offset>. 'cmem' is the
+ * mapped object. Caller must hold dedup_lock.
+ */
+static struct rzs_dedup *ramzswap_dedup_find(struct ramzswap *rzs,
+			struct page *page, u32 offset, unsigned char *cmem,
+			size_t clen)
+{
+	struct rzs_dedup *entry;
+	struct hlist_node *pos;
+	u32 checksum;
+
+	checksum = jhash(cmem + sizeof(struct zobj_header), clen, 0);
+
+	hlist_for_each_entry(entry, pos, dedup_bucket(rzs, checksum), hash)
+		if (entry->page == page && entry->offset == offset)
+			return entry;
+
+	return NULL;
+}
+
+/*
+ * Drop a reference to an indexed object. 'cmem' is the mapped object.
+ * Returns the number of slots still using it.
+ */
+static u32 ramzswap_dedup_put(struct ramzswap *rzs, struct page *page,
+			u32 offset, unsigned char *cmem, size_t clen)
+{
+	struct rzs_dedup *entry, *unused = NULL;
+	u32 refcount = 0;
+
+	spin_lock(&rzs->dedup_lock);
+	entry = ramzswap_dedup_find(rzs, page, offset, cmem, clen);
+	if (entry) {
+		refcount = --entry->refcount;
+		if (!refcount) {
+			hlist_del(&entry->hash);
+			unused = entry;
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	kfree(unused);
+
+	return refcount;
+}
+
+static void ramzswap_dedup_destroy(struct ramzswap *rzs)
+{
+	struct rzs_dedup *entry;
+	struct hlist_node *pos, *n;
+	int i;
+
+	if (!rzs->dedup_hash)
+		return;
+
+	for (i = 0; i < RZS_DEDUP_HASH_SIZE; i++)
+		hlist_for_each_entry_safe(entry, pos, n,
+					  &rzs->dedup_hash[i], hash)
+			kfree(entry);
+
+	vfree(rzs->dedup_hash);
+	rzs->dedup_hash = NULL;
+}
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+static u64 ramzswap_pool_size(struct ramzswap *rzs)
+{
+	u64 size = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		if (stream->mem_pool)
+			size += xv_get_total_size_bytes(stream->mem_pool);
+	}
+
+	return size;
+}
+#endif
+
+/*
+ * Pool memory not taken by objects: what compaction could give back
+ * if it could pack objects perfectly.
+ */
+static u64 ramzswap_pool_wasted(struct ramzswap *rzs)
+{
+	u64 wasted = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		if (stream->mem_pool)
+			wasted += xv_get_total_size_bytes(stream->mem_pool) -
+				  xv_get_used_size_bytes(stream->mem_pool);
+	}
+
+	return wasted;
+}
+
+static void rzs_add_compr_size(struct ramzswap *rzs, long delta)
+{
+	spin_lock(&rzs->stat64_lock);
+	rzs->stats.compr_size += delta;
+	spin_unlock(&rzs->stat64_lock);
+}
+
 static void ramzswap_set_disksize(struct ramzswap *rzs, size_t totalram_bytes)
 {
 	if (!rzs->disksize) {
@@ -125,17 +325,19 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	struct ramzswap_stats *rs = &rzs->stats;
 	size_t succ_writes, mem_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
+	u32 pages_stored = atomic_read(&rs->pages_stored);
+	u32 pages_expand = atomic_read(&rs->pages_expand);
+	u64 pool_size = ramzswap_pool_size(rzs);
 
-	mem_used = xv_get_total_size_bytes(rzs->mem_pool)
-			+ (rs->pages_expand << PAGE_SHIFT);
+	mem_used = pool_size + ((size_t)pages_expand << PAGE_SHIFT);
 	succ_writes = rzs_stat64_read(rzs, &rs->num_writes) -
 			rzs_stat64_read(rzs, &rs->failed_writes);
 
-	if (succ_writes && rs->pages_stored) {
-		good_compress_perc = rs->good_compress * 100
-					/ rs->pages_stored;
-		no_compress_perc = rs->pages_expand * 100
-					/ rs->pages_stored;
+	if (succ_writes && pages_stored) {
+		good_compress_perc = atomic_read(&rs->good_compress) * 100
+					/ pages_stored;
+		no_compress_perc = pages_expand * 100
+					/ pages_stored;
 	}
 
 	s->num_reads = rzs_stat64_read(rzs, &rs->num_reads);
@@ -144,28 +346,62 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	s->failed_writes = rzs_stat64_read(rzs, &rs->failed_writes);
 	s->invalid_io = rzs_stat64_read(rzs, &rs->invalid_io);
 	s->notify_free = rzs_stat64_read(rzs, &rs->notify_free);
-	s->pages_zero = rs->pages_zero;
+	s->pages_zero = atomic_read(&rs->pages_zero);
+	s->pages_same = atomic_read(&rs->pages_same);
+	s->pages_dedup = atomic_read(&rs->pages_dedup);
+	s->dedup_bytes = atomic_read(&rs->dedup_bytes);
+	s->pages_backed = atomic_read(&rs->pages_backed);
+
+	spin_lock_irq(&rzs->wb_lock);
+	s->num_writeback = rs->num_writeback;
+	s->num_readback = rs->num_readback;
+	s->failed_writeback = rs->failed_writeback;
+	if (rs->num_writeback)
+		s->writeback_avg_us = div64_u64(rs->writeback_us,
+						rs->num_writeback);
+	if (rs->num_readback)
+		s->readback_avg_us = div64_u64(rs->readback_us,
+					       rs->num_readback);
+	s->writeback_max_us = rs->writeback_max_us;
+	s->readback_max_us = rs->readback_max_us;
+	spin_unlock_irq(&rzs->wb_lock);
 
 	s->good_compress_pct = good_compress_perc;
 	s->pages_expand_pct = no_compress_perc;
 
-	s->pages_stored = rs->pages_stored;
+	s->pages_stored = pages_stored;
 	s->pages_used = mem_used >> PAGE_SHIFT;
-	s->orig_data_size = rs->pages_stored << PAGE_SHIFT;
+	s->orig_data_size = (u64)pages_stored << PAGE_SHIFT;
+	spin_lock(&rzs->stat64_lock);
 	s->compr_data_size = rs->compr_size;
+	s->pages_compacted = rs->pages_compacted;
+	spin_unlock(&rzs->stat64_lock);
 	s->mem_used_total = mem_used;
+	if (pool_size)
+		s->frag_pct = div64_u64(ramzswap_pool_wasted(rzs) * 100,
+					pool_size);
 	}
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+/*
+ * Caller must hold table_lock.
+ */
+static void __ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
-	u32 clen;
+	u32 clen, shared = 0;
 	void *obj;
 
 	struct page *page = rzs->table[index].page;
 	u32 offset = rzs->table[index].offset;
 
+	if (rzs_test_flag(rzs, index, RZS_SAME)) {
+		rzs_clear_flag(rzs, index, RZS_SAME);
+		rzs_stat_dec(&rzs->stats.pages_same);
+		rzs->table[index].element = 0;
+		return;
+	}
+
 	if (unlikely(!page)) {
 		/*
 		 * No memory is allocated for zero filled pages.
@@ -188,27 +424,471 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 
 	obj = kmap_atomic(page, KM_USER0) + offset;
 	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		rzs_clear_flag(rzs, index, RZS_DEDUP);
+		shared = ramzswap_dedup_put(rzs, page, offset, obj, clen);
+	}
 	kunmap_atomic(obj, KM_USER0);
 
-	xv_free(rzs->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_dec(&rzs->stats.good_compress);
 
+	/* Other slots still use the object */
+	if (shared) {
+		rzs_stat_dec(&rzs->stats.pages_dedup);
+		rzs_stat_add(&rzs->stats.dedup_bytes, -clen);
+		rzs_stat_dec(&rzs->stats.pages_stored);
+		goto clear;
+	}
+
+	xv_free(xv_page_pool(page), page, offset);
+
 out:
-	rzs->stats.compr_size -= clen;
+	rzs_add_compr_size(rzs, -(long)clen);
 	rzs_stat_dec(&rzs->stats.pages_stored);
 
+clear:
 	rzs->table[index].page = NULL;
 	rzs->table[index].offset = 0;
 }
 
-static int handle_zero_page(struct bio *bio)
+/*
+ * A page whose writeback is still in flight is only marked here;
+ * ramzswap_wb_finish() drops it once the write is done.
+ */
+static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+{
+	spin_lock(&rzs->table_lock);
+	if (unlikely(rzs_test_flag(rzs, index, RZS_PENDING))) {
+		rzs_set_flag(rzs, index, RZS_DISCARD);
+	} else if (rzs_test_flag(rzs, index, RZS_BACKED)) {
+		rzs_clear_flag(rzs, index, RZS_BACKED);
+		rzs_stat_dec(&rzs->stats.pages_backed);
+		rzs_stat_dec(&rzs->stats.pages_stored);
+	} else {
+		__ramzswap_free_page(rzs, index);
+	}
+	rzs->table[index].age = 0;
+	spin_unlock(&rzs->table_lock);
+}
+
+static void ramzswap_wb_account(struct ramzswap *rzs, int rw,
+			ktime_t start, int err)
+{
+#if defined(CONFIG_RAMZSWAP_STATS)
+	struct ramzswap_stats *rs = &rzs->stats;
+	u32 us = ktime_us_delta(ktime_get(), start);
+	unsigned long flags;
+
+	spin_lock_irqsave(&rzs->wb_lock, flags);
+	if (rw == WRITE) {
+		if (err) {
+			rs->failed_writeback++;
+		} else {
+			rs->num_writeback++;
+			rs->writeback_us += us;
+			if (us > rs->writeback_max_us)
+				rs->writeback_max_us = us;
+		}
+	} else {
+		rs->num_readback++;
+		rs->readback_us += us;
+		if (us > rs->readback_max_us)
+			rs->readback_max_us = us;
+	}
+	spin_unlock_irqrestore(&rzs->wb_lock, flags);
+#endif
+}
+
+static void ramzswap_remap_end_io(struct bio *bio, int err)
+{
+	struct rzs_remap *remap = bio->bi_private;
+
+	ramzswap_wb_account(remap->rzs, bio_data_dir(bio), remap->start, err);
+
+	bio->bi_end_io = remap->bi_end_io;
+	bio->bi_private = remap->bi_private;
+	kfree(remap);
+
+	bio_endio(bio, err);
+}
+
+/*
+ * Pass a swap request straight on to the backing device, which keeps
+ * every slot at the same offset as the ramzswap device.
+ */
+static int ramzswap_remap(struct ramzswap *rzs, struct bio *bio)
+{
+	struct rzs_remap *remap;
+
+	/* Without the context the request just goes unaccounted */
+	remap = kmalloc(sizeof(*remap), GFP_NOIO);
+	if (remap) {
+		remap->rzs = rzs;
+		remap->bi_end_io = bio->bi_end_io;
+		remap->bi_private = bio->bi_private;
+		remap->start = ktime_get();
+		bio->bi_end_io = ramzswap_remap_end_io;
+		bio->bi_private = remap;
+	}
+
+	bio->bi_bdev = rzs->backing_swap;
+	generic_make_request(bio);
+	return 0;
+}
+
+/*
+ * Settle a slot whose writeback ended. Caller must hold table_lock,
+ * and for 'written' slots readers must already be sent to the backing
+ * device (RZS_BACKED) and be out of the RAM copy.
+ */
+static void ramzswap_wb_finish(struct ramzswap *rzs, u32 index, int written)
+{
+	int discard = rzs_test_flag(rzs, index, RZS_DISCARD);
+
+	rzs_clear_flag(rzs, index, RZS_PENDING);
+	rzs_clear_flag(rzs, index, RZS_DISCARD);
+	rzs->table[index].age = 0;
+
+	/* Write failed: keep the page in RAM */
+	if (!written && !discard)
+		return;
+
+	__ramzswap_free_page(rzs, index);
+	if (discard) {
+		rzs_clear_flag(rzs, index, RZS_BACKED);
+		return;
+	}
+
+	rzs_stat_inc(&rzs->stats.pages_stored);
+	rzs_stat_inc(&rzs->stats.pages_backed);
+}
+
+static void ramzswap_wb_end_io(struct bio *bio, int err)
+{
+	struct rzs_wb *wb = bio->bi_private;
+	struct ramzswap *rzs = wb->rzs;
+	unsigned long flags;
+
+	ramzswap_wb_account(rzs, WRITE, wb->start, err);
+	wb->err = err;
+	bio_put(bio);
+
+	/* Freeing the RAM copy needs process context */
+	spin_lock_irqsave(&rzs->wb_lock, flags);
+	list_add_tail(&wb->list, &rzs->wb_done);
+	spin_unlock_irqrestore(&rzs->wb_lock, flags);
+	schedule_work(&rzs->wb_done_work);
+}
+
+static void ramzswap_wb_done(struct work_struct *work)
+{
+	struct ramzswap *rzs = container_of(work, struct ramzswap,
+					    wb_done_work);
+	struct rzs_wb *wb, *next;
+	LIST_HEAD(done);
+
+	spin_lock_irq(&rzs->wb_lock);
+	list_splice_init(&rzs->wb_done, &done);
+	spin_unlock_irq(&rzs->wb_lock);
+
+	if (list_empty(&done))
+		return;
+
+	/* New readers go to the backing device from here on ... */
+	spin_lock(&rzs->table_lock);
+	list_for_each_entry(wb, &done, list)
+		if (!wb->err)
+			rzs_set_flag(rzs, wb->index, RZS_BACKED);
+	spin_unlock(&rzs->table_lock);
+
+	/* ... and the ones still decompressing the RAM copy finish */
+	synchronize_rcu();
+
+	spin_lock(&rzs->table_lock);
+	list_for_each_entry(wb, &done, list)
+		ramzswap_wb_finish(rzs, wb->index, !wb->err);
+	spin_unlock(&rzs->table_lock);
+
+	list_for_each_entry_safe(wb, next, &done, list) {
+		__free_page(wb->page);
+		kfree(wb);
+		atomic_dec(&rzs->wb_inflight);
+	}
+	wake_up_all(&rzs->wb_wait);
+}
+
+/*
+ * Write the page in slot 'index', which the caller marked RZS_PENDING,
+ * to the backing device. RZS_PENDING keeps the object in place.
+ */
+static int ramzswap_wb_submit(struct ramzswap *rzs, u32 index)
+{
+	int ret;
+	size_t clen = PAGE_SIZE;
+	struct rzs_wb *wb;
+	struct bio *bio;
+	unsigned char *user_mem, *cmem;
+
+	wb = kmalloc(sizeof(*wb), GFP_NOIO);
+	if (!wb)
+		return -ENOMEM;
+
+	wb->page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+	if (!wb->page)
+		goto out_wb;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		goto out_page;
+
+	user_mem = kmap_atomic(wb->page, KM_USER0);
+	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
+			rzs->table[index].offset;
+	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+		memcpy(user_mem, cmem, PAGE_SIZE);
+		ret = LZO_E_OK;
+	} else {
+		ret = lzo1x_decompress_safe(
+			cmem + sizeof(struct zobj_header),
+			xv_get_object_size(cmem) - sizeof(struct zobj_header),
+			user_mem, &clen);
+	}
+	kunmap_atomic(cmem, KM_USER1);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (unlikely(ret != LZO_E_OK)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		bio_put(bio);
+		goto out_page;
+	}
+
+	wb->rzs = rzs;
+	wb->index = index;
+	wb->start = ktime_get();
+
+	bio->bi_bdev = rzs->backing_swap;
+	bio->bi_sector = index << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = ramzswap_wb_end_io;
+	bio->bi_private = wb;
+	bio_add_page(bio, wb->page, PAGE_SIZE, 0);
+
+	atomic_inc(&rzs->wb_inflight);
+	submit_bio(WRITE, bio);
+	return 0;
+
+out_page:
+	__free_page(wb->page);
+out_wb:
+	kfree(wb);
+	return -ENOMEM;
+}
+
+static int ramzswap_wb_eligible(struct ramzswap *rzs, size_t index)
+{
+	return rzs->table[index].page &&
+		!(rzs->table[index].flags & (BIT(RZS_SAME) | BIT(RZS_DEDUP) |
+					     BIT(RZS_BACKED) | BIT(RZS_PENDING) |
+					     BIT(RZS_WRITING)));
+}
+
+/*
+ * Periodic scan for idle pages. Every stored page ages by one per scan;
+ * those that reach wb_age are written back, at most wb_batch per scan,
+ * and submitted back to back so the backing queue can merge them.
+ * Slot 0 holds the swap header and stays in RAM.
+ */
+static void ramzswap_wb_scan(struct work_struct *work)
+{
+	struct ramzswap *rzs = container_of(to_delayed_work(work),
+					    struct ramzswap, wb_work);
+	unsigned int nr = 0;
+	size_t index;
+
+	for (index = 1; index < rzs->backing_pages; index++) {
+		int claim = 0;
+
+		spin_lock(&rzs->table_lock);
+		if (ramzswap_wb_eligible(rzs, index)) {
+			if (rzs->table[index].age >= wb_age && nr < wb_batch) {
+				rzs_set_flag(rzs, index, RZS_PENDING);
+				claim = 1;
+			} else if (rzs->table[index].age < (u8)~0) {
+				rzs->table[index].age++;
+			}
+		}
+		spin_unlock(&rzs->table_lock);
+
+		if (!claim)
+			continue;
+
+		if (ramzswap_wb_submit(rzs, index)) {
+			spin_lock(&rzs->table_lock);
+			ramzswap_wb_finish(rzs, index, 0);
+			spin_unlock(&rzs->table_lock);
+			wake_up_all(&rzs->wb_wait);
+			break;
+		}
+		nr++;
+	}
+
+	if (nr)
+		blk_unplug(bdev_get_queue(rzs->backing_swap));
+
+	if (wb_interval)
+		schedule_delayed_work(&rzs->wb_work, wb_interval * HZ);
+}
+
+/*
+ * xv_compact() callback. The object is moved only if the slot named in
+ * its header still points at it: this skips objects whose write has not
+ * been published yet. Objects shared through dedup and slots under
+ * writeback stay where they are.
+ */
+static int ramzswap_move_object(void *priv, struct page *page, u32 offset,
+			struct page *new_page, u32 new_offset)
+{
+	struct ramzswap *rzs = priv;
+	struct rzs_dedup *entry = NULL;
+	unsigned char *cmem, *new_cmem;
+	u32 index, size;
+	int moved = 0;
+
+	cmem = kmap_atomic(page, KM_USER0) + offset;
+
+	spin_lock(&rzs->table_lock);
+
+	index = ((struct zobj_header *)cmem)->table_idx;
+	if (index >= rzs->disksize >> PAGE_SHIFT ||
+	    rzs->table[index].page != page ||
+	    rzs->table[index].offset != offset ||
+	    rzs->table[index].flags & (BIT(RZS_PENDING) | BIT(RZS_BACKED)))
+		goto out;
+
+	/* Pairs with smp_wmb() in __ramzswap_write() */
+	smp_rmb();
+	size = xv_get_object_size(cmem);
+
+	if (rzs->dedup_hash) {
+		spin_lock(&rzs->dedup_lock);
+		entry = ramzswap_dedup_find(rzs, page, offset, cmem,
+					    size - sizeof(struct zobj_header));
+		if (entry && entry->refcount > 1) {
+			spin_unlock(&rzs->dedup_lock);
+			goto out;
+		}
+	}
+
+	new_cmem = kmap_atomic(new_page, KM_USER1) + new_offset;
+	memcpy(new_cmem, cmem, size);
+	kunmap_atomic(new_cmem, KM_USER1);
+
+	if (rzs->dedup_hash) {
+		if (entry) {
+			entry->page = new_page;
+			entry->offset = new_offset;
+		}
+		spin_unlock(&rzs->dedup_lock);
+	}
+
+	write_seqcount_begin(&rzs->table_seq);
+	rzs->table[index].page = new_page;
+	rzs->table[index].offset = new_offset;
+	write_seqcount_end(&rzs->table_seq);
+	moved = 1;
+
+out:
+	spin_unlock(&rzs->table_lock);
+	kunmap_atomic(cmem, KM_USER0);
+
+	return moved;
+}
+
+/*
+ * Empty sparsely used pages of every per-CPU pool, freeing up to
+ * 'nr_pages' of them. Caller must hold init_lock for read.
+ */
+static u32 ramzswap_compact(struct ramzswap *rzs, u32 nr_pages)
+{
+	u32 freed = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		if (freed >= nr_pages)
+			break;
+		freed += xv_compact(stream->mem_pool, nr_pages - freed,
+				    ramzswap_move_object, rzs);
+	}
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+	spin_lock(&rzs->stat64_lock);
+	rzs->stats.pages_compacted += freed;
+	spin_unlock(&rzs->stat64_lock);
+#endif
+
+	return freed;
+}
+
+/*
+ * Compacts the pools of all initialized devices under memory pressure.
+ * Reports the pool pages not taken by objects as reclaimable.
+ */
+static int ramzswap_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	u64 wasted = 0;
+	u32 freed;
+	int i;
+
+	/*
+	 * Compaction sleeps, and must not run from our own GFP_NOIO
+	 * allocations in the write path.
+	 */
+	if (nr_to_scan && (!(gfp_mask & __GFP_WAIT) || !(gfp_mask & __GFP_IO)))
+		return -1;
+
+	for (i = 0; i < num_devices; i++) {
+		struct ramzswap *rzs = &devices[i];
+
+		if (!down_read_trylock(&rzs->init_lock))
+			continue;
+
+		if (rzs->init_done) {
+			if (nr_to_scan > 0) {
+				freed = ramzswap_compact(rzs, nr_to_scan);
+				nr_to_scan -= min_t(u32, freed, nr_to_scan);
+			}
+			wasted += ramzswap_pool_wasted(rzs);
+		}
+
+		up_read(&rzs->init_lock);
+	}
+
+	return min_t(u64, wasted >> PAGE_SHIFT, INT_MAX);
+}
+
+static struct shrinker ramzswap_shrinker = {
+	.shrink = ramzswap_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int handle_same_page(struct bio *bio, unsigned long element)
 {
 	void *user_mem;
 	struct page *page = bio->bi_io_vec[0].bv_page;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element) {
+		memset(user_mem, 0, PAGE_SIZE);
+	} else {
+		unsigned long *words = user_mem;
+		unsigned int pos;
+
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*words); pos++)
+			words[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -261,23 +941,19 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
-static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
+static int __ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
-	u32 index;
+	u32 index, offset;
+	unsigned seq;
 	size_t clen;
-	struct page *page;
+	struct page *page, *zpage;
 	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem;
 
-	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
-
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	if (rzs_test_flag(rzs, index, RZS_ZERO))
-		return handle_zero_page(bio);
-
 	/* Requested page is not present in compressed area */
 	if (!rzs->table[index].page)
 		return handle_ramzswap_fault(rzs, bio);
@@ -286,11 +962,20 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		return handle_uncompressed_page(rzs, bio);
 
+	/*
+	 * Compaction may be moving the object; the old copy stays valid
+	 * until an RCU grace period after the table points elsewhere.
+	 */
+	do {
+		seq = read_seqcount_begin(&rzs->table_seq);
+		zpage = rzs->table[index].page;
+		offset = rzs->table[index].offset;
+	} while (read_seqcount_retry(&rzs->table_seq, seq));
+
 	user_mem = kmap_atomic(page, KM_USER0);
 	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(zpage, KM_USER1) + offset;
 
 	ret = lzo1x_decompress_safe(
 		cmem + sizeof(*zheader),
@@ -319,13 +1004,45 @@ out:
 	return 0;
 }
 
-static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
+static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
-	u32 offset, index;
+	u32 index;
+
+	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
+
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	if (rzs_test_flag(rzs, index, RZS_ZERO))
+		return handle_same_page(bio, 0);
+
+	if (rzs_test_flag(rzs, index, RZS_SAME))
+		return handle_same_page(bio, rzs->table[index].element);
+
+	/*
+	 * Writeback completion and compaction free the RAM copy of a page
+	 * only after an RCU grace period, so it stays valid while we use it.
+	 */
+	rcu_read_lock();
+	if (rzs_test_flag(rzs, index, RZS_BACKED)) {
+		rcu_read_unlock();
+		return ramzswap_remap(rzs, bio);
+	}
+	ret = __ramzswap_read(rzs, bio);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static int __ramzswap_write(struct ramzswap *rzs, struct bio *bio)
+{
+	int ret;
+	u32 offset, index, checksum = 0;
 	size_t clen;
+	unsigned long element;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct rzs_stream *stream;
 	unsigned char *user_mem, *cmem, *src;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_writes);
@@ -333,29 +1050,36 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
-
-	mutex_lock(&rzs->lock);
-
 	user_mem = kmap_atomic(page, KM_USER0);
-	if (page_zero_filled(user_mem)) {
+	if (page_same_filled(user_mem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
-		rzs_stat_inc(&rzs->stats.pages_zero);
-		rzs_set_flag(rzs, index, RZS_ZERO);
+		if (!element) {
+			rzs_stat_inc(&rzs->stats.pages_zero);
+			rzs_set_flag(rzs, index, RZS_ZERO);
+		} else {
+			rzs_stat_inc(&rzs->stats.pages_same);
+			rzs->table[index].element = element;
+			rzs_set_flag(rzs, index, RZS_SAME);
+		}
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	kunmap_atomic(user_mem, KM_USER0);
+
+	stream = per_cpu_ptr(rzs->streams, raw_smp_processor_id());
+	mutex_lock(&stream->lock);
+	src = stream->compress_buffer;
 
+	user_mem = kmap_atomic(page, KM_USER0);
 	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+				stream->compress_workmem);
 
 	kunmap_atomic(user_mem, KM_USER0);
 
 	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+		mutex_unlock(&stream->lock);
 		pr_err("Compression failed! err=%d\n", ret);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
@@ -367,10 +1091,19 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	 * errors which has side effect of hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
+		/* Better kept on the backing device, if there is one */
+		if (rzs->backing_swap && index < rzs->backing_pages) {
+			mutex_unlock(&stream->lock);
+			rzs_set_flag(rzs, index, RZS_BACKED);
+			rzs_stat_inc(&rzs->stats.pages_stored);
+			rzs_stat_inc(&rzs->stats.pages_backed);
+			return ramzswap_remap(rzs, bio);
+		}
+
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
+			mutex_unlock(&stream->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
@@ -380,15 +1113,24 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		offset = 0;
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
 		rzs_stat_inc(&rzs->stats.pages_expand);
-		rzs->table[index].page = page_store;
 		src = kmap_atomic(page, KM_USER0);
 		goto memstore;
 	}
 
-	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
-			&rzs->table[index].page, &offset,
+	if (rzs->dedup_hash) {
+		checksum = jhash(src, clen, 0);
+		if (ramzswap_dedup_get(rzs, index, src, clen, checksum)) {
+			mutex_unlock(&stream->lock);
+			rzs_stat_inc(&rzs->stats.pages_dedup);
+			rzs_stat_add(&rzs->stats.dedup_bytes, clen);
+			goto stored;
+		}
+	}
+
+	if (xv_malloc(stream->mem_pool, clen + sizeof(*zheader),
+			&page_store, &offset,
 			GFP_NOIO | __GFP_HIGHMEM)) {
-		mutex_unlock(&rzs->lock);
+		mutex_unlock(&stream->lock);
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
@@ -396,34 +1138,41 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	}
 
 memstore:
-	rzs->table[index].offset = offset;
-
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(page_store, KM_USER1) + offset;
 
-#if 0
 	/* Back-reference needed for memory defragmentation */
 	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
 		zheader = (struct zobj_header *)cmem;
 		zheader->table_idx = index;
 		cmem += sizeof(*zheader);
 	}
-#endif
 
 	memcpy(cmem, src, clen);
 
 	kunmap_atomic(cmem, KM_USER1);
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		kunmap_atomic(src, KM_USER0);
+	else if (rzs->dedup_hash)
+		ramzswap_dedup_add(rzs, index, page_store, offset,
+				   clen, checksum);
 
+	mutex_unlock(&stream->lock);
+
+	/*
+	 * Compaction only moves objects the table points at, so publish
+	 * the object after it is complete.
+	 */
+	smp_wmb();
+	rzs->table[index].page = page_store;
+	rzs->table[index].offset = offset;
+
+	rzs_add_compr_size(rzs, clen);
+stored:
 	/* Update stats */
-	rzs->stats.compr_size += clen;
 	rzs_stat_inc(&rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_inc(&rzs->stats.good_compress);
 
-	mutex_unlock(&rzs->lock);
-
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
@@ -433,6 +1182,39 @@ out:
 	return 0;
 }
 
+/*
+ * With a backing device, the idle scanner must not pick up a slot
+ * while it is being written, and a slot freed during its writeback
+ * cannot be reused before the writeback ends.
+ */
+static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
+{
+	u32 index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	int ret;
+
+	if (!rzs->backing_swap)
+		return __ramzswap_write(rzs, bio);
+
+	spin_lock(&rzs->table_lock);
+	while (unlikely(rzs_test_flag(rzs, index, RZS_PENDING))) {
+		spin_unlock(&rzs->table_lock);
+		wait_event(rzs->wb_wait,
+			   !rzs_test_flag(rzs, index, RZS_PENDING));
+		spin_lock(&rzs->table_lock);
+	}
+	rzs_set_flag(rzs, index, RZS_WRITING);
+	rzs->table[index].age = 0;
+	spin_unlock(&rzs->table_lock);
+
+	ret = __ramzswap_write(rzs, bio);
+
+	spin_lock(&rzs->table_lock);
+	rzs_clear_flag(rzs, index, RZS_WRITING);
+	spin_unlock(&rzs->table_lock);
+
+	return ret;
+}
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -484,42 +1266,99 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
-static void reset_device(struct ramzswap *rzs)
+static void free_streams(struct ramzswap *rzs)
 {
-	size_t index;
+	int cpu;
 
-	/* Do not accept any new I/O request */
-	rzs->init_done = 0;
+	if (!rzs->streams)
+		return;
 
-	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
 
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+		kfree(stream->compress_workmem);
+		free_pages((unsigned long)stream->compress_buffer, 1);
+		if (stream->mem_pool)
+			xv_destroy_pool(stream->mem_pool);
+	}
 
-	/* Free all pages that are still in this ramzswap device */
-	for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	free_percpu(rzs->streams);
+	rzs->streams = NULL;
+}
 
-		page = rzs->table[index].page;
-		offset = rzs->table[index].offset;
+static int alloc_streams(struct ramzswap *rzs)
+{
+	int cpu;
 
-		if (!page)
-			continue;
+	rzs->streams = alloc_percpu(struct rzs_stream);
+	if (!rzs->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		mutex_init(&stream->lock);
 
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(rzs->mem_pool, page, offset);
+		stream->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS,
+						   GFP_KERNEL);
+		if (!stream->compress_workmem) {
+			pr_err("Error allocating compressor working memory!\n");
+			return -ENOMEM;
+		}
+
+		stream->compress_buffer =
+			(void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!stream->compress_buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			return -ENOMEM;
+		}
+
+		stream->mem_pool = xv_create_pool();
+		if (!stream->mem_pool) {
+			pr_err("Error creating memory pool\n");
+			return -ENOMEM;
+		}
 	}
 
+	return 0;
+}
+
+static void reset_device(struct ramzswap *rzs)
+{
+	size_t index;
+
+	/* Do not accept any new I/O request, and wait out compaction */
+	down_write(&rzs->init_lock);
+	rzs->init_done = 0;
+	up_write(&rzs->init_lock);
+
+	/* Stop writeback and let what is in flight land */
+	if (rzs->backing_swap) {
+		cancel_delayed_work_sync(&rzs->wb_work);
+		wait_event(rzs->wb_wait, !atomic_read(&rzs->wb_inflight));
+		flush_work(&rzs->wb_done_work);
+	}
+
+	/* Free all pages that are still in this ramzswap device */
+	for (index = 0; rzs->table && index < rzs->disksize >> PAGE_SHIFT;
+	     index++)
+		ramzswap_free_page(rzs, index);
+
 	vfree(rzs->table);
 	rzs->table = NULL;
 
-	xv_destroy_pool(rzs->mem_pool);
-	rzs->mem_pool = NULL;
+	ramzswap_dedup_destroy(rzs);
+
+	if (rzs->backing_swap) {
+		close_bdev_exclusive(rzs->backing_swap,
+				     FMODE_READ | FMODE_WRITE);
+		rzs->backing_swap = NULL;
+	}
+	rzs->backing_pages = 0;
+	memset(rzs->backing_swap_name, 0, sizeof(rzs->backing_swap_name));
+
+	/* Free various per-device buffers */
+	free_streams(rzs);
 
 	/* Reset stats */
 	memset(&rzs->stats, 0, sizeof(rzs->stats));
@@ -541,18 +1380,41 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
+	ret = alloc_streams(rzs);
+	if (ret)
 		goto fail;
+
+	if (rzs->backing_swap_name[0]) {
+		struct block_device *bdev;
+
+		bdev = open_bdev_exclusive(rzs->backing_swap_name,
+					   FMODE_READ | FMODE_WRITE, rzs);
+		if (IS_ERR(bdev)) {
+			pr_err("Error opening backing device: %s\n",
+				rzs->backing_swap_name);
+			ret = PTR_ERR(bdev);
+			goto fail;
+		}
+		rzs->backing_swap = bdev;
+		rzs->backing_pages = min_t(size_t,
+				i_size_read(bdev->bd_inode) >> PAGE_SHIFT,
+				rzs->disksize >> PAGE_SHIFT);
+		pr_info("Using backing device %s for %zu pages\n",
+			rzs->backing_swap_name, rzs->backing_pages);
 	}
 
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
+	if (dedup) {
+		int i;
+
+		rzs->dedup_hash = vmalloc(RZS_DEDUP_HASH_SIZE *
+					  sizeof(*rzs->dedup_hash));
+		if (!rzs->dedup_hash) {
+			pr_err("Error allocating dedup hash table\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+		for (i = 0; i < RZS_DEDUP_HASH_SIZE; i++)
+			INIT_HLIST_HEAD(&rzs->dedup_hash[i]);
 	}
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
@@ -584,15 +1446,11 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	/* ramzswap devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rzs->disk->queue);
 
-	rzs->mem_pool = xv_create_pool();
-	if (!rzs->mem_pool) {
-		pr_err("Error creating memory pool\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
 	rzs->init_done = 1;
 
+	if (rzs->backing_swap && wb_interval)
+		schedule_delayed_work(&rzs->wb_work, wb_interval * HZ);
+
 	pr_debug("Initialization done!\n");
 	return 0;
 
@@ -634,6 +1492,20 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_info("Disk size set to %zu kB\n", disksize_kb);
 		break;
 
+	case RZSIO_SET_BACKING_SWAP:
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(rzs->backing_swap_name, (void *)arg,
+						_IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		rzs->backing_swap_name[MAX_SWAP_NAME_LEN - 1] = '\0';
+		pr_info("Backing device set to %s\n", rzs->backing_swap_name);
+		break;
+
 	case RZSIO_GET_STATS:
 	{
 		struct ramzswap_ioctl_stats *stats;
@@ -659,6 +1531,18 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		ret = ramzswap_ioctl_init_device(rzs);
 		break;
 
+	case RZSIO_COMPACT:
+		down_read(&rzs->init_lock);
+		if (!rzs->init_done) {
+			up_read(&rzs->init_lock);
+			ret = -ENOTTY;
+			goto out;
+		}
+		pr_info("Compaction freed %u pages\n",
+			ramzswap_compact(rzs, UINT_MAX));
+		up_read(&rzs->init_lock);
+		break;
+
 	case RZSIO_RESET:
 		/* Do not reset an active device! */
 		if (bdev->bd_holders) {
@@ -703,8 +1587,17 @@ static int create_device(struct ramzswap *rzs, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&rzs->lock);
 	spin_lock_init(&rzs->stat64_lock);
+	spin_lock_init(&rzs->dedup_lock);
+	spin_lock_init(&rzs->table_lock);
+	seqcount_init(&rzs->table_seq);
+	init_rwsem(&rzs->init_lock);
+	spin_lock_init(&rzs->wb_lock);
+	INIT_DELAYED_WORK(&rzs->wb_work, ramzswap_wb_scan);
+	INIT_WORK(&rzs->wb_done_work, ramzswap_wb_done);
+	INIT_LIST_HEAD(&rzs->wb_done);
+	atomic_set(&rzs->wb_inflight, 0);
+	init_waitqueue_head(&rzs->wb_wait);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!rzs->queue) {
@@ -796,6 +1689,8 @@ static int __init ramzswap_init(void)
 			goto free_devices;
 	}
 
+	register_shrinker(&ramzswap_shrinker);
+
 	return 0;
 
 free_devices:
@@ -812,6 +1707,8 @@ static void __exit ramzswap_exit(void)
 	int i;
 	struct ramzswap *rzs;
 
+	unregister_shrinker(&ramzswap_shrinker);
+
 	for (i = 0; i < num_devices; i++) {
 		rzs = &devices[i];
 
@@ -828,6 +1725,18 @@ static void __exit ramzswap_exit(void)
 
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
+module_param(dedup, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dedup, "Share identical compressed pages "
+		"(applies to devices initialized afterwards)");
+module_param(wb_interval, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wb_interval, "Seconds between scans for idle pages to "
+		"write to the backing device (0: only incompressible pages)");
+module_param(wb_age, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wb_age, "Scans a page must stay unused before it is "
+		"written to the backing device");
+module_param(wb_batch, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wb_batch, "Max pages written to the backing device "
+		"per scan");
 
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
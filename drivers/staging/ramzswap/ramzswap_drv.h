@@ -17,6 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
@@ -34,9 +39,7 @@ static const unsigned max_num_devices = 32;
  * object. This is required to support memory defragmentation.
  */
 struct zobj_header {
-#if 0
 	u32 table_idx;
-#endif
 };
 
 /*-- Configurable parameters */
@@ -56,6 +59,10 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
  * otherwise, xv_malloc() would always return failure.
  */
 
+/* Buckets in the content hash used for deduplication (power of two) */
+#define RZS_DEDUP_HASH_BITS	12
+#define RZS_DEDUP_HASH_SIZE	(1 << RZS_DEDUP_HASH_BITS)
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -71,6 +78,24 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Page is one word repeated; the word is kept in the table */
+	RZS_SAME,
+
+	/* Object is in the dedup index and may be shared with other pages */
+	RZS_DEDUP,
+
+	/* Page lives on the backing device, at the same offset */
+	RZS_BACKED,
+
+	/* Writeback of this page to the backing device is in flight */
+	RZS_PENDING,
+
+	/* Page was freed while RZS_PENDING; drop it when writeback ends */
+	RZS_DISCARD,
+
+	/* A swap write to this slot is in progress */
+	RZS_WRITING,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
@@ -81,9 +106,12 @@ enum rzs_pageflags {
  * These table entries must fit exactly in a page.
  */
 struct table {
-	struct page *page;
+	union {
+		struct page *page;
+		unsigned long element;	/* RZS_SAME */
+	};
 	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	u8 age;		/* writeback scans since the page was stored */
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -99,20 +127,81 @@ struct ramzswap_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-swap I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of pages filled with a non-zero word */
+	atomic_t pages_dedup;	/* no. of pages sharing another's object */
+	atomic_t dedup_bytes;	/* compressed bytes saved by sharing */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	atomic_t pages_backed;	/* no. of pages on the backing device */
+	/* writeback stats, protected by wb_lock */
+	u64 num_writeback;	/* pages written to the backing device */
+	u64 num_readback;	/* pages read back from it */
+	u64 failed_writeback;
+	u64 writeback_us;	/* total latency of the above */
+	u64 readback_us;
+	u32 writeback_max_us;
+	u32 readback_max_us;
+	u64 pages_compacted;	/* pool pages freed by compaction */
 #endif
 };
 
-struct ramzswap {
-	struct xv_pool *mem_pool;
+/*
+ * Per-CPU compression stream. A writer uses the stream of the CPU it
+ * starts on; the mutex only matters if it gets migrated and another
+ * writer picks the same stream. Each stream allocates from its own
+ * xvmalloc pool, so writers on different CPUs never share a lock.
+ */
+struct rzs_stream {
+	struct mutex lock;
 	void *compress_workmem;
 	void *compress_buffer;
+	struct xv_pool *mem_pool;
+};
+
+/*
+ * Entry in the dedup index: one per stored compressed object, keyed by
+ * a hash of its compressed contents.
+ */
+struct rzs_dedup {
+	struct hlist_node hash;
+	struct page *page;
+	u16 offset;
+	u16 clen;
+	u32 checksum;
+	u32 refcount;		/* no. of slots using this object */
+};
+
+struct ramzswap {
+	struct rzs_stream __percpu *streams;	/* see above */
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	struct hlist_head *dedup_hash;	/* NULL unless dedup is enabled */
+	spinlock_t dedup_lock;		/* protects dedup_hash */
+	/*
+	 * Serializes slot state changes that can race with writeback:
+	 * the scanner claiming a slot, its completion and slot frees.
+	 */
+	spinlock_t table_lock;
+	/*
+	 * Compaction moves objects under table_lock; lock-free readers use
+	 * this to get a consistent <page, offset> pair from the table.
+	 */
+	seqcount_t table_seq;
+	/* Held for read while compacting, for write to clear init_done */
+	struct rw_semaphore init_lock;
+
+	/* Optional backing device, see RZSIO_SET_BACKING_SWAP */
+	char backing_swap_name[MAX_SWAP_NAME_LEN];
+	struct block_device *backing_swap;
+	size_t backing_pages;		/* slots that fit on backing_swap */
+	struct delayed_work wb_work;	/* idle page scanner */
+	struct work_struct wb_done_work; /* finishes completed writebacks */
+	struct list_head wb_done;	/* writebacks waiting for wb_done_work */
+	spinlock_t wb_lock;		/* protects wb_done, writeback stats */
+	atomic_t wb_inflight;
+	wait_queue_head_t wb_wait;	/* RZS_PENDING cleared, wb_inflight */
+	spinlock_t stat64_lock;	/* protect 64-bit stats and compr_size */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -130,14 +219,19 @@ struct ramzswap {
 
 /* Debugging and Stats */
 #if defined(CONFIG_RAMZSWAP_STATS)
-static void rzs_stat_inc(u32 *v)
+static void rzs_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
+}
+
+static void rzs_stat_dec(atomic_t *v)
+{
+	atomic_dec(v);
 }
 
-static void rzs_stat_dec(u32 *v)
+static void rzs_stat_add(atomic_t *v, int n)
 {
-	*v = *v - 1;
+	atomic_add(n, v);
 }
 
 static void rzs_stat64_inc(struct ramzswap *rzs, u64 *v)
@@ -160,6 +254,7 @@ static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
 #else
 #define rzs_stat_inc(v)
 #define rzs_stat_dec(v)
+#define rzs_stat_add(v, n)
 #define rzs_stat64_inc(r, v)
 #define rzs_stat64_read(r, v)
 #endif /* CONFIG_RAMZSWAP_STATS */
@@ -15,6 +15,8 @@
 #ifndef _RAMZSWAP_IOCTL_H_
 #define _RAMZSWAP_IOCTL_H_
 
+#define MAX_SWAP_NAME_LEN 128
+
 struct ramzswap_ioctl_stats {
 	u64 disksize;		/* user specified or equal to backing swap
 				 * size (if present) */
@@ -32,11 +34,26 @@ struct ramzswap_ioctl_stats {
 	u64 orig_data_size;
 	u64 compr_data_size;
 	u64 mem_used_total;
+	u32 pages_same;		/* no. of pages filled with a non-zero word */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u64 dedup_bytes;	/* compressed bytes saved by sharing */
+	u32 pages_backed;	/* no. of pages on the backing device */
+	u32 writeback_avg_us;	/* average and worst latencies of */
+	u32 writeback_max_us;	/* backing device writes and reads */
+	u32 readback_avg_us;
+	u32 readback_max_us;
+	u64 num_writeback;	/* pages written to backing device */
+	u64 num_readback;	/* pages read back from it */
+	u64 failed_writeback;
+	u32 frag_pct;		/* % of pool memory not used by objects */
+	u64 pages_compacted;	/* pool pages freed by compaction */
 } __attribute__ ((packed, aligned(4)));
 
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_GET_STATS		_IOR('z', 1, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 2)
 #define RZSIO_RESET		_IO('z', 3)
+#define RZSIO_SET_BACKING_SWAP	_IOW('z', 4, unsigned char[MAX_SWAP_NAME_LEN])
+#define RZSIO_COMPACT		_IO('z', 5)
 
 #endif
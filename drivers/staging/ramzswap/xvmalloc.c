@@ -14,6 +14,8 @@
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 
@@ -79,6 +81,25 @@ static struct block_header *BLOCK_NEXT(struct block_header *block)
 		((char *)block + block->size + XV_ALIGN);
 }
 
+/*
+ * Distance to the next block header. Unlike BLOCK_NEXT(), also works
+ * for allocated blocks, whose size is the unaligned requested size.
+ */
+static u32 block_span(struct block_header *block)
+{
+	return ALIGN(block->size, XV_ALIGN) + XV_ALIGN;
+}
+
+/*
+ * Bytes allocated from a page, block headers included, are kept in
+ * page->index so that compaction can tell sparse pages apart.
+ */
+static void page_used_add(struct xv_pool *pool, struct page *page, long bytes)
+{
+	page->index += bytes;
+	pool->used_bytes += bytes;
+}
+
 /*
  * Get index of free list containing blocks of maximum size
  * which is less than or equal to given size.
@@ -284,9 +305,13 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	if (unlikely(!page))
 		return -ENOMEM;
 
-	stat_inc(&pool->total_pages);
+	/* Lets xv_page_pool() find the owner when a block is freed */
+	set_page_private(page, (unsigned long)pool);
+	page->index = 0;
 
 	spin_lock(&pool->lock);
+	stat_inc(&pool->total_pages);
+	list_add(&page->lru, &pool->pages);
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -317,6 +342,8 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
+	mutex_init(&pool->compact_lock);
 
 	return pool;
 }
@@ -326,55 +353,23 @@ void xv_destroy_pool(struct xv_pool *pool)
 	kfree(pool);
 }
 
-/**
- * xv_malloc - Allocate block of given size from pool.
- * @pool: pool to allocate from
- * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
- *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
- *
- * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+/*
+ * Carve a block for a 'size' byte object out of the free lists. Caller
+ * holds pool->lock. On success <page, offset> points past the block
+ * header; on failure they are untouched and -ENOMEM is returned.
  */
-int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
-		u32 *offset, gfp_t flags)
+static int alloc_block(struct xv_pool *pool, u32 size, struct page **page,
+			u32 *offset)
 {
-	int error;
 	u32 index, tmpsize, origsize, tmpoffset;
 	struct block_header *block, *tmpblock;
 
-	*page = NULL;
-	*offset = 0;
 	origsize = size;
-
-	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
-		return -ENOMEM;
-
 	size = ALIGN(size, XV_ALIGN);
 
-	spin_lock(&pool->lock);
-
 	index = find_block(pool, size, page, offset);
-
-	if (!*page) {
-		spin_unlock(&pool->lock);
-		if (flags & GFP_NOWAIT)
-			return -ENOMEM;
-		error = grow_pool(pool, flags);
-		if (unlikely(error))
-			return error;
-
-		spin_lock(&pool->lock);
-		index = find_block(pool, size, page, offset);
-	}
-
-	if (!*page) {
-		spin_unlock(&pool->lock);
+	if (!*page)
 		return -ENOMEM;
-	}
 
 	block = get_ptr_atomic(*page, *offset, KM_USER0);
 
@@ -405,20 +400,66 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 
 	block->size = origsize;
 	clear_flag(block, BLOCK_FREE);
+	page_used_add(pool, *page, size + XV_ALIGN);
 
 	put_ptr_atomic(block, KM_USER0);
-	spin_unlock(&pool->lock);
 
 	*offset += XV_ALIGN;
 
 	return 0;
 }
 
+/**
+ * xv_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @page: page no. that holds the object
+ * @offset: location of object within page
+ *
+ * On success, <page, offset> identifies block allocated
+ * and 0 is returned. On failure, <page, offset> is set to
+ * 0 and -ENOMEM is returned.
+ *
+ * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+ */
+int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	int error;
+
+	*page = NULL;
+	*offset = 0;
+
+	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	spin_lock(&pool->lock);
+
+	error = alloc_block(pool, size, page, offset);
+
+	if (error) {
+		spin_unlock(&pool->lock);
+		if (flags & GFP_NOWAIT)
+			return -ENOMEM;
+		error = grow_pool(pool, flags);
+		if (unlikely(error))
+			return error;
+
+		spin_lock(&pool->lock);
+		error = alloc_block(pool, size, page, offset);
+	}
+
+	spin_unlock(&pool->lock);
+
+	return error;
+}
+
 /*
  * Free block identified with <page, offset>
  */
 void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 {
+	int isolated;
 	void *page_start;
 	struct block_header *block, *tmpblock;
 
@@ -426,6 +467,9 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 
 	spin_lock(&pool->lock);
 
+	/* Free blocks of a page under compaction stay off the freelists */
+	isolated = page == pool->isolated;
+
 	page_start = get_ptr_atomic(page, 0, KM_USER0);
 	block = (struct block_header *)((char *)page_start + offset);
 
@@ -433,6 +477,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	BUG_ON(test_flag(block, BLOCK_FREE));
 
 	block->size = ALIGN(block->size, XV_ALIGN);
+	page_used_add(pool, page, -(long)(block->size + XV_ALIGN));
 
 	tmpblock = BLOCK_NEXT(block);
 	if (offset + block->size + XV_ALIGN == PAGE_SIZE)
@@ -444,7 +489,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 		 * Blocks smaller than XV_MIN_ALLOC_SIZE
 		 * are not inserted in any free list.
 		 */
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE) {
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE && !isolated) {
 			remove_block(pool, page,
 				    offset + block->size + XV_ALIGN, tmpblock,
 				    get_index_for_insert(tmpblock->size));
@@ -458,7 +503,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 						get_blockprev(block));
 		offset = offset - tmpblock->size - XV_ALIGN;
 
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE && !isolated)
 			remove_block(pool, page, offset, tmpblock,
 				    get_index_for_insert(tmpblock->size));
 
@@ -466,18 +511,20 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 		block = tmpblock;
 	}
 
-	/* No used objects in this page. Free it. */
-	if (block->size == PAGE_SIZE - XV_ALIGN) {
+	/* No used objects in this page. Free it, unless compaction will. */
+	if (block->size == PAGE_SIZE - XV_ALIGN && !isolated) {
+		stat_dec(&pool->total_pages);
+		list_del(&page->lru);
 		put_ptr_atomic(page_start, KM_USER0);
 		spin_unlock(&pool->lock);
 
+		set_page_private(page, 0);
 		__free_page(page);
-		stat_dec(&pool->total_pages);
 		return;
 	}
 
 	set_flag(block, BLOCK_FREE);
-	if (block->size >= XV_MIN_ALLOC_SIZE)
+	if (block->size >= XV_MIN_ALLOC_SIZE && !isolated)
 		insert_block(pool, page, offset, block);
 
 	if (offset + block->size + XV_ALIGN != PAGE_SIZE) {
@@ -490,6 +537,14 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	spin_unlock(&pool->lock);
 }
 
+/*
+ * Returns the pool a page handed out by xv_malloc() belongs to
+ */
+struct xv_pool *xv_page_pool(struct page *page)
+{
+	return (struct xv_pool *)page_private(page);
+}
+
 u32 xv_get_object_size(void *obj)
 {
 	struct block_header *blk;
@@ -505,3 +560,219 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+
+/*
+ * Returns memory taken by allocated objects and their headers
+ */
+u64 xv_get_used_size_bytes(struct xv_pool *pool)
+{
+	return pool->used_bytes;
+}
+
+/*
+ * Take the next page with less than XV_COMPACT_THRESHOLD bytes in use
+ * off the page list, looking at no more than *budget pages. Its free
+ * blocks are pulled off the freelists so nothing is allocated from it
+ * while its objects are moved out.
+ */
+static struct page *isolate_sparse_page(struct xv_pool *pool, u64 *budget)
+{
+	u32 offset;
+	void *page_start;
+	struct page *page = NULL;
+	struct block_header *block;
+
+	spin_lock(&pool->lock);
+
+	while (*budget && !list_empty(&pool->pages)) {
+		(*budget)--;
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_move_tail(&page->lru, &pool->pages);
+		if (page->index < XV_COMPACT_THRESHOLD)
+			break;
+		page = NULL;
+	}
+
+	if (!page) {
+		spin_unlock(&pool->lock);
+		return NULL;
+	}
+
+	list_del(&page->lru);
+	pool->isolated = page;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (offset = 0; offset != PAGE_SIZE; offset += block_span(block)) {
+		block = (struct block_header *)((char *)page_start + offset);
+		if (test_flag(block, BLOCK_FREE) &&
+		    block->size >= XV_MIN_ALLOC_SIZE)
+			remove_block(pool, page, offset, block,
+				    get_index_for_insert(block->size));
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	spin_unlock(&pool->lock);
+
+	return page;
+}
+
+/*
+ * Return the isolated page to the pool, or free it if nothing is left
+ * in it. Returns 1 if the page was freed.
+ */
+static int putback_page(struct xv_pool *pool, struct page *page)
+{
+	u32 offset;
+	void *page_start;
+	struct block_header *block;
+
+	spin_lock(&pool->lock);
+
+	pool->isolated = NULL;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	block = page_start;
+
+	if (test_flag(block, BLOCK_FREE) &&
+	    block->size == PAGE_SIZE - XV_ALIGN) {
+		stat_dec(&pool->total_pages);
+		put_ptr_atomic(page_start, KM_USER0);
+		spin_unlock(&pool->lock);
+
+		set_page_private(page, 0);
+		__free_page(page);
+		return 1;
+	}
+
+	for (offset = 0; offset != PAGE_SIZE; offset += block_span(block)) {
+		block = (struct block_header *)((char *)page_start + offset);
+		if (test_flag(block, BLOCK_FREE) &&
+		    block->size >= XV_MIN_ALLOC_SIZE)
+			insert_block(pool, page, offset, block);
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	/* At the tail, so the next pass does not start with it */
+	list_add_tail(&page->lru, &pool->pages);
+
+	spin_unlock(&pool->lock);
+
+	return 0;
+}
+
+/*
+ * Find the first allocated block at or after 'start' in the isolated
+ * page. Blocks around it may merge as objects get freed, so the walk
+ * always starts from the beginning of the page. Returns PAGE_SIZE if
+ * there is none.
+ */
+static u32 next_used_block(struct xv_pool *pool, struct page *page,
+			u32 start, u32 *size)
+{
+	u32 offset;
+	void *page_start;
+	struct block_header *block;
+
+	spin_lock(&pool->lock);
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (offset = 0; offset != PAGE_SIZE; offset += block_span(block)) {
+		block = (struct block_header *)((char *)page_start + offset);
+		if (offset >= start && !test_flag(block, BLOCK_FREE)) {
+			*size = block->size;
+			break;
+		}
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	spin_unlock(&pool->lock);
+
+	return offset;
+}
+
+/*
+ * Free the old copies of moved objects once no reader can still be
+ * looking at them.
+ */
+static void free_moved(struct xv_pool *pool, struct page *page,
+			u32 *offsets, u32 count)
+{
+	u32 i;
+
+	synchronize_rcu();
+
+	for (i = 0; i < count; i++)
+		xv_free(pool, page, offsets[i]);
+}
+
+/**
+ * xv_compact - move objects out of sparsely used pages
+ * @pool: pool to compact
+ * @nr_pages: stop after freeing this many pages
+ * @move: relocates a single object, see xv_move_t
+ * @priv: passed on to @move
+ *
+ * Objects in pages with less than XV_COMPACT_THRESHOLD bytes in use
+ * are moved to free blocks in the other pages of the pool, and pages
+ * left empty are freed. No new pages are allocated: compaction stops
+ * once the rest of the pool is full. May sleep.
+ *
+ * Returns the number of pages freed.
+ */
+u32 xv_compact(struct xv_pool *pool, u32 nr_pages, xv_move_t move,
+			void *priv)
+{
+	int full = 0;
+	u64 budget;
+	u32 freed = 0, nr_moved = 0;
+	u32 offset, size, new_offset;
+	u32 moved[XV_COMPACT_BATCH];
+	struct page *page, *new_page;
+
+	mutex_lock(&pool->compact_lock);
+
+	/* Look at every page at most once */
+	budget = pool->total_pages;
+
+	while (!full && freed < nr_pages) {
+		page = isolate_sparse_page(pool, &budget);
+		if (!page)
+			break;
+
+		for (offset = 0; ; offset += ALIGN(size, XV_ALIGN) + XV_ALIGN) {
+			offset = next_used_block(pool, page, offset, &size);
+			if (offset == PAGE_SIZE)
+				break;
+
+			spin_lock(&pool->lock);
+			full = alloc_block(pool, size, &new_page, &new_offset);
+			spin_unlock(&pool->lock);
+			if (full)
+				break;
+
+			if (!move(priv, page, offset + XV_ALIGN,
+				  new_page, new_offset)) {
+				xv_free(pool, new_page, new_offset);
+				continue;
+			}
+
+			moved[nr_moved++] = offset + XV_ALIGN;
+			if (nr_moved == XV_COMPACT_BATCH) {
+				free_moved(pool, page, moved, nr_moved);
+				nr_moved = 0;
+			}
+		}
+
+		if (nr_moved) {
+			free_moved(pool, page, moved, nr_moved);
+			nr_moved = 0;
+		}
+
+		freed += putback_page(pool, page);
+		cond_resched();
+	}
+
+	mutex_unlock(&pool->compact_lock);
+
+	return freed;
+}
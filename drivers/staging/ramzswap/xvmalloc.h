@@ -15,16 +15,32 @@
 
 #include <linux/types.h>
 
+struct page;
 struct xv_pool;
 
+/*
+ * Called by xv_compact() to move the object at <page, offset> to the
+ * freshly allocated <new_page, new_offset>: copy it and repoint its
+ * users. Return nonzero if the object was moved. Users must access
+ * objects under rcu_read_lock(); the old copy is freed after a grace
+ * period.
+ */
+typedef int (*xv_move_t)(void *priv, struct page *page, u32 offset,
+			struct page *new_page, u32 new_offset);
+
 struct xv_pool *xv_create_pool(void);
 void xv_destroy_pool(struct xv_pool *pool);
 
 int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 			u32 *offset, gfp_t flags);
 void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
+struct xv_pool *xv_page_pool(struct page *page);
 
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
+u64 xv_get_used_size_bytes(struct xv_pool *pool);
+
+u32 xv_compact(struct xv_pool *pool, u32 nr_pages, xv_move_t move,
+			void *priv);
 
 #endif
@@ -15,6 +15,8 @@
 
 #include <linux/kernel.h>
 #include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 
 /* User configurable params */
 
@@ -36,6 +38,12 @@
 
 #define MAX_FLI		DIV_ROUND_UP(NUM_FREE_LISTS, BITS_PER_LONG)
 
+/* Pages with less than this many bytes in use get compacted */
+#define XV_COMPACT_THRESHOLD	(PAGE_SIZE / 2)
+
+/* Objects moved between RCU grace periods during compaction */
+#define XV_COMPACT_BATCH	32
+
 /* End of user params */
 
 enum blockflags {
@@ -79,8 +87,14 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
+	struct list_head pages;		/* all pages, linked by page->lru */
+	struct page *isolated;		/* page being compacted; its free
+					 * blocks are not on any freelist */
+	struct mutex compact_lock;	/* one compaction at a time */
+
 	/* stats */
 	u64 total_pages;
+	u64 used_bytes;			/* objects plus their headers */
 };
 
 #endif
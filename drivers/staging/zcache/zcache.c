@@ -0,0 +1,575 @@
+/*
+ * Compressed cache for clean page-cache pages
+ *
+ * Clean file pages evicted from the page cache are handed over by the
+ * cleancache hooks, LZO-compressed and kept in memory, within a bound
+ * set as a percentage of RAM. A later read of the same page is served
+ * from here instead of the storage device.
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zcache"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cleancache.h>
+#include <linux/highmem.h>
+#include <linux/kobject.h>
+#include <linux/lzo.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/radix-tree.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+/*-- Configurable parameters */
+
+/* Filesystems that can use the cache at the same time */
+#define ZCACHE_MAX_POOLS	32
+
+/* Pages that compress to more than this are not worth keeping */
+static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
+
+/* Pages looked up at once when a whole file is flushed */
+#define ZCACHE_FLUSH_BATCH	16
+
+/*-- End of configurable params */
+
+struct zcache_obj;
+
+/* A compressed page */
+struct zcache_page {
+	struct list_head lru;		/* on zcache_lru, oldest first */
+	struct zcache_obj *obj;
+	pgoff_t index;
+	u16 size;			/* compressed length */
+	unsigned char data[0];
+};
+
+/* One per filesystem, see zcache_init_fs() */
+struct zcache_pool {
+	struct rb_root objs;
+	int in_use;
+};
+
+/* The cached pages of one file, indexed by page offset */
+struct zcache_obj {
+	struct rb_node node;
+	struct zcache_pool *pool;
+	struct cleancache_filekey key;
+	struct radix_tree_root pages;
+	unsigned long nr_pages;
+};
+
+/* Per-CPU compressor working memory and output buffer */
+struct zcache_buffers {
+	void *workmem;
+	unsigned char *dst;
+};
+
+static DEFINE_PER_CPU(struct zcache_buffers, zcache_buffers);
+
+/*
+ * Protects the pools, the LRU and the counters. Puts and flushes come
+ * from under mapping->tree_lock, which is also taken from interrupts,
+ * so it is always taken with interrupts disabled.
+ */
+static DEFINE_SPINLOCK(zcache_lock);
+static struct zcache_pool zcache_pools[ZCACHE_MAX_POOLS];
+static LIST_HEAD(zcache_lru);
+
+/* Module params (documentation at end) */
+static unsigned int pool_percent = 10;
+
+/* Stats, exported in /sys/kernel/mm/zcache */
+static unsigned long zcache_hits;
+static unsigned long zcache_misses;
+static unsigned long zcache_puts;
+static unsigned long zcache_rejects;
+static unsigned long zcache_evictions;
+static unsigned long zcache_flushes;
+static unsigned long zcache_stored_pages;
+static unsigned long zcache_pool_bytes;
+
+static unsigned long zcache_pool_limit(void)
+{
+	return (totalram_pages * pool_percent / 100) << PAGE_SHIFT;
+}
+
+static struct zcache_pool *zcache_get_pool(int pool_id)
+{
+	if (pool_id < 0 || pool_id >= ZCACHE_MAX_POOLS ||
+	    !zcache_pools[pool_id].in_use)
+		return NULL;
+
+	return &zcache_pools[pool_id];
+}
+
+/*
+ * Find the object of file 'key'. If there is none and 'new' is given,
+ * 'new' is set up and inserted instead. Caller holds zcache_lock.
+ */
+static struct zcache_obj *zcache_find_obj(struct zcache_pool *pool,
+			struct cleancache_filekey *key, struct zcache_obj *new)
+{
+	struct rb_node **link = &pool->objs.rb_node, *parent = NULL;
+	struct zcache_obj *obj;
+	int cmp;
+
+	while (*link) {
+		parent = *link;
+		obj = rb_entry(parent, struct zcache_obj, node);
+		cmp = memcmp(key->u.key, obj->key.u.key, sizeof(key->u.key));
+		if (cmp < 0)
+			link = &parent->rb_left;
+		else if (cmp > 0)
+			link = &parent->rb_right;
+		else
+			return obj;
+	}
+
+	if (!new)
+		return NULL;
+
+	new->pool = pool;
+	new->key = *key;
+	INIT_RADIX_TREE(&new->pages, GFP_NOWAIT | __GFP_NOWARN);
+	new->nr_pages = 0;
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &pool->objs);
+
+	return new;
+}
+
+static struct zcache_page *zcache_lookup(struct zcache_pool *pool,
+			struct cleancache_filekey *key, pgoff_t index)
+{
+	struct zcache_obj *obj;
+
+	obj = zcache_find_obj(pool, key, NULL);
+	if (!obj)
+		return NULL;
+
+	return radix_tree_lookup(&obj->pages, index);
+}
+
+/*
+ * Take a page out of the cache; the caller frees it. The object goes
+ * away with its last page. Caller holds zcache_lock.
+ */
+static void zcache_unlink(struct zcache_page *zpage)
+{
+	struct zcache_obj *obj = zpage->obj;
+
+	radix_tree_delete(&obj->pages, zpage->index);
+	list_del(&zpage->lru);
+	zcache_stored_pages--;
+	zcache_pool_bytes -= ksize(zpage);
+
+	if (!--obj->nr_pages) {
+		rb_erase(&obj->node, &obj->pool->objs);
+		kfree(obj);
+	}
+}
+
+/*
+ * Drop up to 'nr' of the least recently stored pages.
+ * Caller holds zcache_lock.
+ */
+static void zcache_evict(unsigned long nr)
+{
+	struct zcache_page *zpage;
+
+	while (nr-- && !list_empty(&zcache_lru)) {
+		zpage = list_first_entry(&zcache_lru, struct zcache_page, lru);
+		zcache_unlink(zpage);
+		kfree(zpage);
+		zcache_evictions++;
+	}
+}
+
+/*
+ * Drop all pages of a file, and with them the object itself.
+ * Caller holds zcache_lock.
+ */
+static void zcache_flush_obj(struct zcache_obj *obj)
+{
+	struct zcache_page *batch[ZCACHE_FLUSH_BATCH];
+	unsigned long left = obj->nr_pages;
+	unsigned int nr, i;
+
+	while (left) {
+		nr = radix_tree_gang_lookup(&obj->pages, (void **)batch, 0,
+					    ZCACHE_FLUSH_BATCH);
+		left -= nr;
+		for (i = 0; i < nr; i++) {
+			zcache_unlink(batch[i]);
+			kfree(batch[i]);
+			zcache_flushes++;
+		}
+	}
+}
+
+/*
+ * Compress 'page' into a newly allocated zcache_page. Returns NULL if
+ * it does not compress well or there is no memory for it; the put path
+ * cannot sleep, nor should it dig into reserves.
+ */
+static struct zcache_page *zcache_compress(struct page *page, pgoff_t index)
+{
+	struct zcache_buffers *buffers;
+	struct zcache_page *zpage = NULL;
+	unsigned char *src;
+	size_t clen;
+	int ret;
+
+	buffers = &get_cpu_var(zcache_buffers);
+
+	src = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_1_compress(src, PAGE_SIZE, buffers->dst, &clen,
+			       buffers->workmem);
+	kunmap_atomic(src, KM_USER0);
+
+	if (ret == LZO_E_OK && clen <= max_zpage_size)
+		zpage = kmalloc(sizeof(*zpage) + clen,
+				GFP_NOWAIT | __GFP_NOWARN);
+	if (zpage) {
+		memcpy(zpage->data, buffers->dst, clen);
+		zpage->size = clen;
+		zpage->index = index;
+	}
+
+	put_cpu_var(zcache_buffers);
+
+	return zpage;
+}
+
+/*
+ * cleancache operations
+ */
+
+static int zcache_init_fs(size_t pagesize)
+{
+	unsigned long flags;
+	int pool_id;
+
+	if (pagesize != PAGE_SIZE)
+		return -1;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	for (pool_id = 0; pool_id < ZCACHE_MAX_POOLS; pool_id++) {
+		if (!zcache_pools[pool_id].in_use) {
+			zcache_pools[pool_id].in_use = 1;
+			zcache_pools[pool_id].objs = RB_ROOT;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	if (pool_id == ZCACHE_MAX_POOLS) {
+		pr_info("Out of pools, filesystem will not be cached\n");
+		return -1;
+	}
+
+	return pool_id;
+}
+
+/* Pages are never shared between filesystems, not even clustered ones */
+static int zcache_init_shared_fs(char *uuid, size_t pagesize)
+{
+	return zcache_init_fs(pagesize);
+}
+
+/*
+ * Pages are handed out only once: after a hit the page is back in the
+ * page cache, and will be put again when it is evicted again.
+ */
+static int zcache_get_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index, struct page *page)
+{
+	struct zcache_pool *pool;
+	struct zcache_page *zpage = NULL;
+	unsigned long flags;
+	unsigned char *dst;
+	size_t len = PAGE_SIZE;
+	int ret;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool)
+		zpage = zcache_lookup(pool, &key, index);
+	if (zpage) {
+		zcache_unlink(zpage);
+		zcache_hits++;
+	} else {
+		zcache_misses++;
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	if (!zpage)
+		return -1;
+
+	dst = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_decompress_safe(zpage->data, zpage->size, dst, &len);
+	kunmap_atomic(dst, KM_USER0);
+	kfree(zpage);
+
+	/* should NEVER happen */
+	if (unlikely(ret != LZO_E_OK || len != PAGE_SIZE)) {
+		pr_err("Decompression failed! err=%d, index=%lu\n",
+			ret, (unsigned long)index);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void zcache_put_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index, struct page *page)
+{
+	struct zcache_pool *pool;
+	struct zcache_page *zpage, *old;
+	struct zcache_obj *obj, *new_obj;
+	unsigned long flags;
+
+	zpage = zcache_compress(page, index);
+	new_obj = kmalloc(sizeof(*new_obj), GFP_NOWAIT | __GFP_NOWARN);
+
+	spin_lock_irqsave(&zcache_lock, flags);
+
+	pool = zcache_get_pool(pool_id);
+	if (!pool)
+		goto out;
+
+	/* Whatever is cached for this page is stale now */
+	old = zcache_lookup(pool, &key, index);
+	if (old) {
+		zcache_unlink(old);
+		kfree(old);
+	}
+
+	if (!zpage)
+		goto reject;
+
+	obj = zcache_find_obj(pool, &key, new_obj);
+	if (!obj)
+		goto reject;
+	if (obj == new_obj)
+		new_obj = NULL;
+
+	if (radix_tree_insert(&obj->pages, index, zpage)) {
+		if (!obj->nr_pages) {
+			rb_erase(&obj->node, &pool->objs);
+			kfree(obj);
+		}
+		goto reject;
+	}
+
+	zpage->obj = obj;
+	obj->nr_pages++;
+	list_add_tail(&zpage->lru, &zcache_lru);
+	zcache_stored_pages++;
+	zcache_pool_bytes += ksize(zpage);
+	zcache_puts++;
+	zpage = NULL;
+
+	/* Stay within bounds, dropping the oldest pages first */
+	while (zcache_pool_bytes > zcache_pool_limit() &&
+	       !list_empty(&zcache_lru))
+		zcache_evict(1);
+	goto out;
+
+reject:
+	zcache_rejects++;
+out:
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	kfree(zpage);
+	kfree(new_obj);
+}
+
+static void zcache_flush_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index)
+{
+	struct zcache_pool *pool;
+	struct zcache_page *zpage = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool)
+		zpage = zcache_lookup(pool, &key, index);
+	if (zpage) {
+		zcache_unlink(zpage);
+		zcache_flushes++;
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	kfree(zpage);
+}
+
+static void zcache_flush_inode(int pool_id, struct cleancache_filekey key)
+{
+	struct zcache_pool *pool;
+	struct zcache_obj *obj;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool) {
+		obj = zcache_find_obj(pool, &key, NULL);
+		if (obj)
+			zcache_flush_obj(obj);
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+static void zcache_flush_fs(int pool_id)
+{
+	struct zcache_pool *pool;
+	struct rb_node *node;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool) {
+		while ((node = rb_first(&pool->objs)))
+			zcache_flush_obj(rb_entry(node, struct zcache_obj,
+						  node));
+		pool->in_use = 0;
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+static struct cleancache_ops zcache_ops = {
+	.init_fs = zcache_init_fs,
+	.init_shared_fs = zcache_init_shared_fs,
+	.get_page = zcache_get_page,
+	.put_page = zcache_put_page,
+	.flush_page = zcache_flush_page,
+	.flush_inode = zcache_flush_inode,
+	.flush_fs = zcache_flush_fs,
+};
+
+/*
+ * Gives memory back under pressure, oldest pages first.
+ */
+static int zcache_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	unsigned long flags, nr;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	if (nr_to_scan > 0)
+		zcache_evict(nr_to_scan);
+	nr = zcache_stored_pages;
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	return min_t(unsigned long, nr, INT_MAX);
+}
+
+static struct shrinker zcache_shrinker = {
+	.shrink = zcache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+#ifdef CONFIG_SYSFS
+
+#define ZCACHE_SYSFS_RO(_name) \
+	static ssize_t zcache_##_name##_show(struct kobject *kobj, \
+				struct kobj_attribute *attr, char *buf) \
+	{ \
+		return sprintf(buf, "%lu\n", zcache_##_name); \
+	} \
+	static struct kobj_attribute zcache_##_name##_attr = { \
+		.attr = { .name = __stringify(_name), .mode = 0444 }, \
+		.show = zcache_##_name##_show, \
+	}
+
+ZCACHE_SYSFS_RO(hits);
+ZCACHE_SYSFS_RO(misses);
+ZCACHE_SYSFS_RO(puts);
+ZCACHE_SYSFS_RO(rejects);
+ZCACHE_SYSFS_RO(evictions);
+ZCACHE_SYSFS_RO(flushes);
+ZCACHE_SYSFS_RO(stored_pages);
+ZCACHE_SYSFS_RO(pool_bytes);
+
+static struct attribute *zcache_attrs[] = {
+	&zcache_hits_attr.attr,
+	&zcache_misses_attr.attr,
+	&zcache_puts_attr.attr,
+	&zcache_rejects_attr.attr,
+	&zcache_evictions_attr.attr,
+	&zcache_flushes_attr.attr,
+	&zcache_stored_pages_attr.attr,
+	&zcache_pool_bytes_attr.attr,
+	NULL,
+};
+
+static struct attribute_group zcache_attr_group = {
+	.attrs = zcache_attrs,
+	.name = "zcache",
+};
+
+#endif /* CONFIG_SYSFS */
+
+static void free_buffers(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct zcache_buffers *buffers = &per_cpu(zcache_buffers, cpu);
+
+		kfree(buffers->workmem);
+		free_pages((unsigned long)buffers->dst, 1);
+		buffers->workmem = NULL;
+		buffers->dst = NULL;
+	}
+}
+
+static int __init zcache_init(void)
+{
+	struct cleancache_ops old_ops;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct zcache_buffers *buffers = &per_cpu(zcache_buffers, cpu);
+
+		buffers->workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+		/* Compressed output may be somewhat larger than a page */
+		buffers->dst = (void *)__get_free_pages(GFP_KERNEL, 1);
+		if (!buffers->workmem || !buffers->dst) {
+			pr_err("Error allocating compressor buffers\n");
+			free_buffers();
+			return -ENOMEM;
+		}
+	}
+
+#ifdef CONFIG_SYSFS
+	if (sysfs_create_group(mm_kobj, &zcache_attr_group))
+		pr_warning("Unable to create sysfs stats\n");
+#endif
+
+	register_shrinker(&zcache_shrinker);
+
+	old_ops = cleancache_register_ops(&zcache_ops);
+	if (old_ops.init_fs)
+		pr_warning("Replaced another cleancache backend\n");
+
+	pr_info("Caching clean pages in up to %u%% of RAM\n", pool_percent);
+	return 0;
+}
+
+module_param(pool_percent, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pool_percent, "Max memory for compressed pages, "
+		"in percent of RAM");
+
+module_init(zcache_init);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Compressed cache for clean page-cache pages");
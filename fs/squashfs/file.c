@@ -371,27 +371,125 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
-static int squashfs_readpage(struct file *file, struct page *page)
+/*
+ * The direct path keeps every page of the block kmapped while it
+ * decompresses, which may sleep.  Each highmem page holds a pkmap slot
+ * for that long, and readers that each held part of the pkmap area while
+ * waiting in kmap() for the rest would deadlock every kmap() user.  So
+ * the slots the direct path may hold at once, across all readers, come
+ * from a budget of half the pkmap area; blocks that do not fit in what
+ * is left go through the cache path instead.
+ */
+#ifdef CONFIG_HIGHMEM
+#define SQUASHFS_DIRECT_KMAPS	(LAST_PKMAP / 2)
+
+static atomic_t squashfs_direct_kmaps = ATOMIC_INIT(0);
+
+static int squashfs_get_kmaps(int highmem)
+{
+	if (highmem && atomic_add_return(highmem, &squashfs_direct_kmaps) >
+			SQUASHFS_DIRECT_KMAPS) {
+		atomic_sub(highmem, &squashfs_direct_kmaps);
+		return 0;
+	}
+	return 1;
+}
+
+static void squashfs_put_kmaps(int highmem)
+{
+	if (highmem)
+		atomic_sub(highmem, &squashfs_direct_kmaps);
+}
+#else
+static inline int squashfs_get_kmaps(int highmem)
+{
+	return 1;
+}
+
+static inline void squashfs_put_kmaps(int highmem)
+{
+}
+#endif
+
+/*
+ * Decompress datablock @block straight into the page cache pages covering
+ * it, without going through the read_page cache.  This is only possible
+ * if every page of the block could be grabbed and none is uptodate yet,
+ * otherwise -EAGAIN is returned and the caller copies from the cache.
+ */
+static int squashfs_read_direct(struct inode *inode, u64 block, int bsize,
+	struct page **page, int pages)
+{
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	void **pageaddr;
+	int i, bytes, highmem = 0;
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL || PageUptodate(page[i]))
+			return -EAGAIN;
+		if (PageHighMem(page[i]))
+			highmem++;
+	}
+
+	pageaddr = kmalloc(pages * sizeof(void *), GFP_KERNEL);
+	if (pageaddr == NULL)
+		return -EAGAIN;
+
+	if (!squashfs_get_kmaps(highmem)) {
+		kfree(pageaddr);
+		return -EAGAIN;
+	}
+
+	for (i = 0; i < pages; i++)
+		pageaddr[i] = kmap(page[i]);
+
+	bytes = squashfs_read_data(inode->i_sb, pageaddr, block, bsize, NULL,
+		msblk->block_size, pages);
+
+	if (bytes >= 0) {
+		/* Zero what the block does not cover of its last page */
+		for (i = 0; i < pages; i++, bytes -= PAGE_CACHE_SIZE)
+			if (bytes < (int) PAGE_CACHE_SIZE)
+				memset(pageaddr[i] + max(bytes, 0), 0,
+					PAGE_CACHE_SIZE - max(bytes, 0));
+		bytes = 0;
+	}
+
+	for (i = 0; i < pages; i++) {
+		kunmap(page[i]);
+		if (bytes == 0) {
+			flush_dcache_page(page[i]);
+			SetPageUptodate(page[i]);
+		}
+	}
+	squashfs_put_kmaps(highmem);
+	kfree(pageaddr);
+
+	if (bytes < 0) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Fill the @pages page cache pages of file block @index.  @page[i] is the
+ * locked page at offset i in the block, or NULL if it could not be had.
+ * All the pages are unlocked and released on return.
+ */
+static void squashfs_fill_block(struct inode *inode, int index,
+	struct page **page, int pages)
 {
-	struct inode *inode = page->mapping->host;
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	int bytes, i, offset = 0, sparse = 0;
+	int bytes, i, offset = 0, sparse = 0, err;
 	struct squashfs_cache_entry *buffer = NULL;
 	void *pageaddr;
 
-	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
-	int index = page->index >> (msblk->block_log - PAGE_CACHE_SHIFT);
-	int start_index = page->index & ~mask;
-	int end_index = start_index | mask;
 	int file_end = i_size_read(inode) >> msblk->block_log;
 
-	TRACE("Entered squashfs_readpage, page index %lx, start block %llx\n",
-				page->index, squashfs_i(inode)->start);
-
-	if (page->index >= ((i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
-					PAGE_CACHE_SHIFT))
-		goto out;
-
 	if (index < file_end || squashfs_i(inode)->fragment_block ==
 					SQUASHFS_INVALID_BLK) {
 		/*
@@ -410,8 +508,16 @@ static int squashfs_readpage(struct file *file, struct page *page)
 			sparse = 1;
 		} else {
 			/*
-			 * Read and decompress datablock.
+			 * Decompress datablock into the pages if we can,
+			 * otherwise through the read_page cache.
 			 */
+			err = squashfs_read_direct(inode, block, bsize, page,
+				pages);
+			if (err == 0)
+				goto release;
+			if (err != -EAGAIN)
+				goto error_out;
+
 			buffer = squashfs_get_datablock(inode->i_sb,
 								block, bsize);
 			if (buffer->error) {
@@ -443,46 +549,110 @@ static int squashfs_readpage(struct file *file, struct page *page)
 	}
 
 	/*
-	 * Loop copying datablock into pages.  As the datablock likely covers
-	 * many PAGE_CACHE_SIZE pages (default block size is 128 KiB) explicitly
-	 * grab the pages from the page cache, except for the page that we've
-	 * been called to fill.
+	 * Loop copying datablock into pages.
 	 */
-	for (i = start_index; i <= end_index && bytes > 0; i++,
+	for (i = 0; i < pages && bytes > 0; i++,
 			bytes -= PAGE_CACHE_SIZE, offset += PAGE_CACHE_SIZE) {
-		struct page *push_page;
 		int avail = sparse ? 0 : min_t(int, bytes, PAGE_CACHE_SIZE);
 
 		TRACE("bytes %d, i %d, available_bytes %d\n", bytes, i, avail);
 
-		push_page = (i == page->index) ? page :
-			grab_cache_page_nowait(page->mapping, i);
-
-		if (!push_page)
+		if (!page[i] || PageUptodate(page[i]))
 			continue;
 
-		if (PageUptodate(push_page))
-			goto skip_page;
-
-		pageaddr = kmap_atomic(push_page, KM_USER0);
+		pageaddr = kmap_atomic(page[i], KM_USER0);
 		squashfs_copy_data(pageaddr, buffer, offset, avail);
 		memset(pageaddr + avail, 0, PAGE_CACHE_SIZE - avail);
 		kunmap_atomic(pageaddr, KM_USER0);
-		flush_dcache_page(push_page);
-		SetPageUptodate(push_page);
-skip_page:
-		unlock_page(push_page);
-		if (i != page->index)
-			page_cache_release(push_page);
+		flush_dcache_page(page[i]);
+		SetPageUptodate(page[i]);
 	}
 
 	if (!sparse)
 		squashfs_cache_put(buffer);
 
-	return 0;
+	goto release;
 
 error_out:
-	SetPageError(page);
+	for (i = 0; i < pages; i++) {
+		if (!page[i] || PageUptodate(page[i]))
+			continue;
+
+		pageaddr = kmap_atomic(page[i], KM_USER0);
+		memset(pageaddr, 0, PAGE_CACHE_SIZE);
+		kunmap_atomic(pageaddr, KM_USER0);
+		flush_dcache_page(page[i]);
+		SetPageError(page[i]);
+	}
+release:
+	for (i = 0; i < pages; i++) {
+		if (!page[i])
+			continue;
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+}
+
+
+/*
+ * Number of pages of file block @index that lie inside the file.
+ */
+static int squashfs_block_pages(struct inode *inode, int index)
+{
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int file_pages = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+					PAGE_CACHE_SHIFT;
+
+	return min(1 << shift, file_pages - (index << shift));
+}
+
+
+static int squashfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	struct page **block_page;
+	int i, pages;
+	void *pageaddr;
+
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int index = page->index >> (msblk->block_log - PAGE_CACHE_SHIFT);
+	int start_index = page->index & ~mask;
+
+	TRACE("Entered squashfs_readpage, page index %lx, start block %llx\n",
+				page->index, squashfs_i(inode)->start);
+
+	if (page->index >= ((i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+					PAGE_CACHE_SHIFT))
+		goto out;
+
+	pages = squashfs_block_pages(inode, index);
+	block_page = kcalloc(pages, sizeof(*block_page), GFP_KERNEL);
+	if (block_page == NULL) {
+		SetPageError(page);
+		goto out;
+	}
+
+	/*
+	 * As the datablock likely covers many PAGE_CACHE_SIZE pages (default
+	 * block size is 128 KiB) explicitly grab the pages from the page
+	 * cache, except for the page that we've been called to fill.
+	 */
+	for (i = 0; i < pages; i++) {
+		if (start_index + i == page->index) {
+			page_cache_get(page);
+			block_page[i] = page;
+		} else
+			block_page[i] = grab_cache_page_nowait(page->mapping,
+						start_index + i);
+	}
+
+	squashfs_fill_block(inode, index, block_page, pages);
+	kfree(block_page);
+
+	return 0;
+
 out:
 	pageaddr = kmap_atomic(page, KM_USER0);
 	memset(pageaddr, 0, PAGE_CACHE_SIZE);
@@ -496,6 +666,67 @@ out:
 }
 
 
+#define list_to_page(head) (list_entry((head)->prev, struct page, lru))
+
+/*
+ * Readahead.  The pages on @pages are in ascending index order; take the
+ * ones belonging to the same datablock off the list together, add the
+ * rest of the block from the page cache and fill the whole block with a
+ * single decompression.
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	struct page **block_page;
+	struct page *page;
+	int i, index, start_index, count;
+
+	block_page = kmalloc(sizeof(*block_page) << shift, GFP_KERNEL);
+	if (block_page == NULL)
+		return -ENOMEM;
+
+	while (!list_empty(pages)) {
+		page = list_to_page(pages);
+		index = page->index >> shift;
+		start_index = index << shift;
+		count = squashfs_block_pages(inode, index);
+		if (count <= 0)
+			break;
+
+		memset(block_page, 0, sizeof(*block_page) << shift);
+
+		while (!list_empty(pages)) {
+			page = list_to_page(pages);
+			if (page->index >= start_index + count)
+				break;
+
+			list_del(&page->lru);
+			if (add_to_page_cache_lru(page, mapping, page->index,
+						GFP_KERNEL)) {
+				page_cache_release(page);
+				continue;
+			}
+			block_page[page->index - start_index] = page;
+		}
+
+		for (i = 0; i < count; i++)
+			if (block_page[i] == NULL)
+				block_page[i] = grab_cache_page_nowait(mapping,
+							start_index + i);
+
+		squashfs_fill_block(inode, index, block_page, count);
+	}
+
+	kfree(block_page);
+
+	return 0;
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
@@ -12,6 +12,7 @@
  */
 
 #include "yaffs_checkptrw.h"
+#include "yaffs_nand.h"
 #include "yaffs_getblockinfo.h"
 
 static int yaffs2_CheckpointSpaceOk(yaffs_Device *dev)
@@ -29,6 +30,7 @@ static int yaffs2_CheckpointSpaceOk(yaffs_Device *dev)
 static int yaffs2_CheckpointErase(yaffs_Device *dev)
 {
 	int i;
+	int result;
 
 	if (!dev->param.eraseBlockInNAND)
 		return 0;
@@ -42,7 +44,11 @@ static int yaffs2_CheckpointErase(yaffs_Device *dev)
 
 			dev->nBlockErasures++;
 
-			if (dev->param.eraseBlockInNAND(dev, i - dev->blockOffset /* realign */)) {
+			yaffs_NANDAccessBegin(dev);
+			result = dev->param.eraseBlockInNAND(dev, i - dev->blockOffset /* realign */);
+			yaffs_NANDAccessEnd(dev);
+
+			if (result) {
 				bi->blockState = YAFFS_BLOCK_STATE_EMPTY;
 				dev->nErasedBlocks++;
 				dev->nFreeChunks += dev->param.nChunksPerBlock;
@@ -100,8 +106,10 @@ static void yaffs2_CheckpointFindNextCheckpointBlock(yaffs_Device *dev)
 			int chunk = i * dev->param.nChunksPerBlock;
 			int realignedChunk = chunk - dev->chunkOffset;
 
+			yaffs_NANDAccessBegin(dev);
 			dev->param.readChunkWithTagsFromNAND(dev, realignedChunk,
 					NULL, &tags);
+			yaffs_NANDAccessEnd(dev);
 			T(YAFFS_TRACE_CHECKPOINT, (TSTR("find next checkpt block: search: block %d oid %d seq %d eccr %d" TENDSTR),
 				i, tags.objectId, tags.sequenceNumber, tags.eccResult));
 
@@ -223,8 +231,10 @@ static int yaffs2_CheckpointFlushBuffer(yaffs_Device *dev)
 
 	dev->nPageWrites++;
 
+	yaffs_NANDAccessBegin(dev);
 	dev->param.writeChunkWithTagsToNAND(dev, realignedChunk,
 			dev->checkpointBuffer, &tags);
+	yaffs_NANDAccessEnd(dev);
 	dev->checkpointByteOffset = 0;
 	dev->checkpointPageSequence++;
 	dev->checkpointCurrentChunk++;
@@ -315,10 +325,12 @@ int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
 
 				/* read in the next chunk */
 				/* printf("read checkpoint page %d\n",dev->checkpointPage); */
+				yaffs_NANDAccessBegin(dev);
 				dev->param.readChunkWithTagsFromNAND(dev,
 						realignedChunk,
 						dev->checkpointBuffer,
 						&tags);
+				yaffs_NANDAccessEnd(dev);
 
 				if (tags.chunkId != (dev->checkpointPageSequence + 1) ||
 					tags.eccResult > YAFFS_ECC_RESULT_FIXED ||
@@ -52,6 +52,7 @@ static void yaffs_HandleUpdateChunk(yaffs_Device *dev, int chunkInNAND,
 				const yaffs_ExtendedTags *tags);
 
 /* Other local prototypes */
+static void yaffs_GCQueueUpdate(yaffs_Device *dev, int blockNo);
 static void yaffs_UpdateParent(yaffs_Object *obj);
 static int yaffs_UnlinkObject(yaffs_Object *obj);
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj);
@@ -274,7 +275,7 @@ int yaffs_IsManagedTempBuffer(yaffs_Device *dev, const __u8 *buffer)
 			return 1;
 	}
 
-	for (i = 0; i < dev->param.nShortOpCaches; i++) {
+	for (i = 0; i < dev->nSrCacheBuffers; i++) {
 		if (dev->srCache[i].data == buffer)
 			return 1;
 	}
@@ -526,6 +527,7 @@ static void yaffs_RetireBlock(yaffs_Device *dev, int blockInNAND)
 	bi->blockState = YAFFS_BLOCK_STATE_DEAD;
 	bi->gcPrioritise = 0;
 	bi->needsRetiring = 0;
+	yaffs_GCQueueUpdate(dev, blockInNAND);
 
 	dev->nRetiredBlocks++;
 }
@@ -612,6 +614,123 @@ static __u16 yaffs_CalcNameSum(const YCHAR *name)
 	return sum;
 }
 
+/* Hash of the whole name, as far as names are compared. 0 for no name */
+static __u32 yaffs_CalcNameHash(const YCHAR *name)
+{
+	__u32 hash = 0;
+	int i;
+
+	if (!name || !name[0])
+		return 0;
+
+	for (i = 0; name[i] && i < YAFFS_MAX_NAME_LENGTH; i++)
+		hash = hash * 31 + (__u32)name[i];
+
+	return hash ? hash : 1;
+}
+
+/*
+ * Big directories get their children hashed by name so that lookups don't
+ * have to walk the whole children list. The hash is built by the first
+ * lookup that finds the directory big enough and then kept up to date as
+ * children come, go and get renamed. If it gets too full it is dropped and
+ * the next lookup builds a bigger one.
+ */
+
+static int yaffs_ObjectNameKnown(yaffs_Object *obj)
+{
+	/* lost+found has a made up name, and an object without a header
+	 * or short name is called objxxx */
+	if (obj->objectId == YAFFS_OBJECTID_LOSTNFOUND || !obj->nameHash)
+		return 0;
+#ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
+	if (obj->shortName[0])
+		return 1;
+#endif
+	return obj->hdrChunk > 0;
+}
+
+static struct ylist_head *yaffs_NameBucket(yaffs_Object *dir,
+					   yaffs_Object *obj)
+{
+	yaffs_DirectoryStructure *dS = &dir->variant.directoryVariant;
+
+	if (!yaffs_ObjectNameKnown(obj))
+		return &dS->nameHash[dS->nNameBuckets];
+	return &dS->nameHash[obj->nameHash & (dS->nNameBuckets - 1)];
+}
+
+static void yaffs_BuildNameHash(yaffs_Object *dir)
+{
+	yaffs_DirectoryStructure *dS = &dir->variant.directoryVariant;
+	struct ylist_head *i;
+	struct ylist_head *buckets;
+	yaffs_Object *l;
+	int nBuckets = 1;
+	int b;
+
+	/* Leave room for the directory to double before a rebuild */
+	while (nBuckets * YAFFS_DIR_HASH_MAX_LOAD < dS->nChildren * 2)
+		nBuckets <<= 1;
+
+	buckets = YMALLOC((nBuckets + 1) * sizeof(struct ylist_head));
+	if (!buckets)
+		return;
+	for (b = 0; b <= nBuckets; b++)
+		YINIT_LIST_HEAD(&buckets[b]);
+
+	/* Loading the names first, that would rehash the objects otherwise */
+	ylist_for_each(i, &dS->children)
+		yaffs_CheckObjectDetailsLoaded(ylist_entry(i, yaffs_Object,
+							   siblings));
+
+	dS->nameHash = buckets;
+	dS->nNameBuckets = nBuckets;
+	ylist_for_each(i, &dS->children) {
+		l = ylist_entry(i, yaffs_Object, siblings);
+		ylist_add(&l->nameLink, yaffs_NameBucket(dir, l));
+	}
+}
+
+static void yaffs_FreeNameHash(yaffs_Object *dir)
+{
+	yaffs_DirectoryStructure *dS = &dir->variant.directoryVariant;
+	struct ylist_head *i;
+
+	if (!dS->nameHash)
+		return;
+
+	ylist_for_each(i, &dS->children)
+		ylist_del_init(&ylist_entry(i, yaffs_Object, siblings)->nameLink);
+
+	YFREE(dS->nameHash);
+	dS->nameHash = NULL;
+	dS->nNameBuckets = 0;
+}
+
+/* obj has just been put on the children list of dir */
+static void yaffs_AddToNameHash(yaffs_Object *dir, yaffs_Object *obj)
+{
+	yaffs_DirectoryStructure *dS = &dir->variant.directoryVariant;
+
+	dS->nChildren++;
+	if (!dS->nameHash)
+		return;
+	if (dS->nChildren > dS->nNameBuckets * YAFFS_DIR_HASH_MAX_LOAD)
+		yaffs_FreeNameHash(dir);
+	else
+		ylist_add(&obj->nameLink, yaffs_NameBucket(dir, obj));
+}
+
+/* The name or header of obj changed, move it to the right bucket */
+static void yaffs_RehashObjectName(yaffs_Object *obj)
+{
+	if (!ylist_empty(&obj->nameLink)) {
+		ylist_del(&obj->nameLink);
+		ylist_add(&obj->nameLink, yaffs_NameBucket(obj->parent, obj));
+	}
+}
+
 void yaffs_SetObjectName(yaffs_Object *obj, const YCHAR *name)
 {
 #ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
@@ -622,6 +741,8 @@ void yaffs_SetObjectName(yaffs_Object *obj, const YCHAR *name)
 		obj->shortName[0] = _Y('\0');
 #endif
 	obj->sum = yaffs_CalcNameSum(name);
+	obj->nameHash = yaffs_CalcNameHash(name);
+	yaffs_RehashObjectName(obj);
 }
 
 void yaffs_SetObjectNameFromOH(yaffs_Object *obj, const yaffs_ObjectHeader *oh)
@@ -667,6 +788,18 @@ static void yaffs_FreeTnode(yaffs_Device *dev, yaffs_Tnode *tn)
 
 static void yaffs_DeinitialiseTnodesAndObjects(yaffs_Device *dev)
 {
+	struct ylist_head *i;
+	yaffs_Object *obj;
+	int bucket;
+
+	/* The objects go with the allocator, their name hashes don't */
+	for (bucket = 0; bucket < YAFFS_NOBJECT_BUCKETS; bucket++)
+		ylist_for_each(i, &dev->objectBucket[bucket].list) {
+			obj = ylist_entry(i, yaffs_Object, hashLink);
+			if (obj->variantType == YAFFS_OBJECT_TYPE_DIRECTORY)
+				yaffs_FreeNameHash(obj);
+		}
+
 	yaffs_DeinitialiseRawTnodesAndObjects(dev);
 	dev->nObjects = 0;
 	dev->nTnodes = 0;
@@ -1026,6 +1159,7 @@ static void yaffs_SoftDeleteChunk(yaffs_Device *dev, int chunk)
 		theBlock->softDeletions++;
 		dev->nFreeChunks++;
 		yaffs2_UpdateOldestDirtySequence(dev, blockNo, theBlock);
+		yaffs_GCQueueUpdate(dev, blockNo);
 	}
 }
 
@@ -1238,12 +1372,14 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&(obj->hardLinks));
 		YINIT_LIST_HEAD(&(obj->hashLink));
 		YINIT_LIST_HEAD(&obj->siblings);
+		YINIT_LIST_HEAD(&obj->nameLink);
 
 
 		/* Now make the directory sane */
 		if (dev->rootDir) {
 			obj->parent = dev->rootDir;
 			ylist_add(&(obj->siblings), &dev->rootDir->variant.directoryVariant.children);
+			yaffs_AddToNameHash(dev->rootDir, obj);
 		}
 
 		/* Add it to the lost and found directory.
@@ -1320,6 +1456,9 @@ static void yaffs_FreeObject(yaffs_Object *obj)
 
 	yaffs_UnhashObject(obj);
 
+	if (obj->variantType == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_FreeNameHash(obj);
+
 	yaffs_FreeRawObject(dev,obj);
 	dev->nObjects--;
 	dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
@@ -1491,6 +1630,9 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 					children);
 			YINIT_LIST_HEAD(&theObject->variant.directoryVariant.
 					dirty);
+			theObject->variant.directoryVariant.nChildren = 0;
+			theObject->variant.directoryVariant.nameHash = NULL;
+			theObject->variant.directoryVariant.nNameBuckets = 0;
 			break;
 		case YAFFS_OBJECT_TYPE_SYMLINK:
 		case YAFFS_OBJECT_TYPE_HARDLINK:
@@ -1816,12 +1958,60 @@ int yaffs_RenameObject(yaffs_Object *oldDir, const YCHAR *oldName,
 
 /*------------------------- Block Management and Page Allocation ----------------*/
 
+/*
+ * The GC queue keeps the full blocks sorted by how many live pages they
+ * hold: bucket n lists the full blocks with n pages in use, so the
+ * dirtiest candidate is found without scanning the block info. Only full
+ * blocks are queued; anything else just drops out.
+ */
+
+static void yaffs_GCQueueUpdate(yaffs_Device *dev, int blockNo)
+{
+	yaffs_BlockInfo *bi;
+	struct ylist_head *link;
+	int pagesUsed;
+
+	if (!dev->gcQueue ||
+	    blockNo < dev->internalStartBlock ||
+	    blockNo > dev->internalEndBlock)
+		return;
+
+	bi = yaffs_GetBlockInfo(dev, blockNo);
+	link = &dev->gcQueueLinks[blockNo - dev->internalStartBlock];
+	pagesUsed = bi->pagesInUse - bi->softDeletions;
+
+	ylist_del_init(link);
+	if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
+	    pagesUsed >= 0 && pagesUsed < dev->param.nChunksPerBlock)
+		ylist_add_tail(link, &dev->gcQueue[pagesUsed]);
+}
+
+static int yaffs_GCQueueBlock(yaffs_Device *dev, struct ylist_head *link)
+{
+	return (link - dev->gcQueueLinks) + dev->internalStartBlock;
+}
+
+/* Scanning and checkpoint restore set up the block info wholesale */
+static void yaffs_RebuildGCQueue(yaffs_Device *dev)
+{
+	int i;
+
+	if (!dev->gcQueue)
+		return;
+
+	for (i = dev->internalStartBlock; i <= dev->internalEndBlock; i++)
+		yaffs_GCQueueUpdate(dev, i);
+}
+
 static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 {
 	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	int i;
 
 	dev->blockInfo = NULL;
 	dev->chunkBits = NULL;
+	dev->gcQueue = NULL;
+	dev->gcQueueLinks = NULL;
 
 	dev->allocationBlock = -1;	/* force it to get a new one */
 
@@ -1845,8 +2035,20 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 	}
 
 	if (dev->blockInfo && dev->chunkBits) {
+		dev->gcQueue = YMALLOC(dev->param.nChunksPerBlock *
+					sizeof(struct ylist_head));
+		dev->gcQueueLinks = YMALLOC_ALT(nBlocks *
+					sizeof(struct ylist_head));
+	}
+
+	if (dev->blockInfo && dev->chunkBits &&
+	    dev->gcQueue && dev->gcQueueLinks) {
 		memset(dev->blockInfo, 0, nBlocks * sizeof(yaffs_BlockInfo));
 		memset(dev->chunkBits, 0, dev->chunkBitmapStride * nBlocks);
+		for (i = 0; i < dev->param.nChunksPerBlock; i++)
+			YINIT_LIST_HEAD(&dev->gcQueue[i]);
+		for (i = 0; i < nBlocks; i++)
+			YINIT_LIST_HEAD(&dev->gcQueueLinks[i]);
 		return YAFFS_OK;
 	}
 
@@ -1870,6 +2072,13 @@ static void yaffs_DeinitialiseBlocks(yaffs_Device *dev)
 		YFREE(dev->chunkBits);
 	dev->chunkBitsAlt = 0;
 	dev->chunkBits = NULL;
+
+	if (dev->gcQueue)
+		YFREE(dev->gcQueue);
+	dev->gcQueue = NULL;
+	if (dev->gcQueueLinks)
+		YFREE_ALT(dev->gcQueueLinks);
+	dev->gcQueueLinks = NULL;
 }
 
 void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
@@ -1889,6 +2098,7 @@ void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 	yaffs2_ClearOldestDirtySequence(dev,bi);
 
 	bi->blockState = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_GCQueueUpdate(dev, blockNo);
 
 	/* If this is the block being garbage collected then stop gc'ing this block */
 	if(blockNo == dev->gcBlock)
@@ -2052,6 +2262,7 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* If the block is full set the state to full */
 		if (dev->allocationPage >= dev->param.nChunksPerBlock) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			yaffs_GCQueueUpdate(dev, dev->allocationBlock);
 			dev->allocationBlock = -1;
 		}
 
@@ -2090,6 +2301,7 @@ void yaffs_SkipRestOfBlock(yaffs_Device *dev)
 		yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, dev->allocationBlock);
 		if(bi->blockState == YAFFS_BLOCK_STATE_ALLOCATING){
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			yaffs_GCQueueUpdate(dev, dev->allocationBlock);
 			dev->allocationBlock = -1;
 		}
 	}
@@ -2131,7 +2343,8 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 	if(bi->blockState == YAFFS_BLOCK_STATE_FULL)
 		bi->blockState = YAFFS_BLOCK_STATE_COLLECTING;
-	
+	yaffs_GCQueueUpdate(dev, block);
+
 	bi->hasShrinkHeader = 0;	/* clear the flag so that the block can erase */
 
 	dev->gcDisable = 1;
@@ -2327,6 +2540,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 		 * because checkpointing does not restore gc.
 		 */
 		bi->blockState = YAFFS_BLOCK_STATE_FULL;
+		yaffs_GCQueueUpdate(dev, block);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2428,6 +2642,8 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	if (!selected){
 		int pagesUsed;
 		int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+		struct ylist_head *l;
+
 		if (aggressive){
 			threshold = dev->param.nChunksPerBlock;
 			iterations = nBlocks;
@@ -2454,30 +2670,32 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 				iterations = 100;
 		}
 
-		for (i = 0;
-			i < iterations &&
-			(dev->gcDirtiest < 1 ||
-				dev->gcPagesInUse > YAFFS_GC_GOOD_ENOUGH);
-			i++) {
-			dev->gcBlockFinder++;
-			if (dev->gcBlockFinder < dev->internalStartBlock ||
-				dev->gcBlockFinder > dev->internalEndBlock)
-				dev->gcBlockFinder = dev->internalStartBlock;
-
-			bi = yaffs_GetBlockInfo(dev, dev->gcBlockFinder);
-
-			pagesUsed = bi->pagesInUse - bi->softDeletions;
-
-			if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-				pagesUsed < dev->param.nChunksPerBlock &&
-				(dev->gcDirtiest < 1 || pagesUsed < dev->gcPagesInUse) &&
-				yaffs2_BlockNotDisqualifiedFromGC(dev, bi)) {
-				dev->gcDirtiest = dev->gcBlockFinder;
-				dev->gcPagesInUse = pagesUsed;
+		/* Walk the GC queue from the dirtiest bucket up. Blocks
+		 * disqualified by a shrink header are passed over, but only
+		 * so many of them.
+		 */
+		dev->gcDirtiest = 0;
+		dev->gcPagesInUse = 0;
+		for (pagesUsed = 0;
+			pagesUsed < dev->param.nChunksPerBlock &&
+			pagesUsed <= threshold &&
+			iterations > 0 &&
+			!dev->gcDirtiest;
+			pagesUsed++) {
+			ylist_for_each(l, &dev->gcQueue[pagesUsed]) {
+				if (iterations-- <= 0)
+					break;
+				i = yaffs_GCQueueBlock(dev, l);
+				bi = yaffs_GetBlockInfo(dev, i);
+				if (yaffs2_BlockNotDisqualifiedFromGC(dev, bi)) {
+					dev->gcDirtiest = i;
+					dev->gcPagesInUse = pagesUsed;
+					break;
+				}
 			}
 		}
 
-		if(dev->gcDirtiest > 0 && dev->gcPagesInUse <= threshold)
+		if(dev->gcDirtiest > 0)
 			selected = dev->gcDirtiest;
 	}
 
@@ -2518,8 +2736,8 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	} else{
 		dev->gcNotDone++;
 		T(YAFFS_TRACE_GC,
-		  (TSTR("GC none: finder %d skip %d threshold %d dirtiest %d using %d oldest %d%s" TENDSTR),
-		  dev->gcBlockFinder, dev->gcNotDone,
+		  (TSTR("GC none: skip %d threshold %d dirtiest %d using %d oldest %d%s" TENDSTR),
+		  dev->gcNotDone,
 		  threshold,
 		  dev->gcDirtiest, dev->gcPagesInUse,
 		  dev->oldestDirtyBlock,
@@ -2603,6 +2821,8 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 		}
 
 		if (dev->gcBlock > 0) {
+			__u32 copiesBefore = dev->nGCCopies;
+
 			dev->allGCs++;
 			if (!aggressive)
 				dev->passiveGCs++;
@@ -2613,6 +2833,12 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 			   dev->nErasedBlocks, aggressive));
 
 			gcOk = yaffs_GarbageCollectBlock(dev, dev->gcBlock, aggressive);
+
+			if (!background) {
+				dev->foregroundGCs++;
+				dev->foregroundGCCopies +=
+					dev->nGCCopies - copiesBefore;
+			}
 		}
 
 		if (dev->nErasedBlocks < (dev->param.nReservedBlocks) && dev->gcBlock > 0) {
@@ -2918,6 +3144,7 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn)
 		yaffs_ClearChunkBit(dev, block, page);
 
 		bi->pagesInUse--;
+		yaffs_GCQueueUpdate(dev, block);
 
 		if (bi->pagesInUse == 0 &&
 		    !bi->hasShrinkHeader &&
@@ -3139,6 +3366,8 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
 		if (newChunkId >= 0) {
 
 			in->hdrChunk = newChunkId;
+			if (prevChunkId <= 0)
+				yaffs_RehashObjectName(in);
 
 			if (prevChunkId > 0) {
 				yaffs_DeleteChunk(dev, prevChunkId, 1,
@@ -3176,19 +3405,73 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The cache can hold a few hundred chunks, so cached chunks are found
+ *   through a hash on object and chunk id and kept on a list in least
+ *   recently used order. Entries get their data buffer the first time they
+ *   are needed, up to nShortOpCaches of them. Unused entries that have a
+ *   buffer sit on the free list.
  */
 
+static struct ylist_head *yaffs_ChunkCacheBucket(yaffs_Device *dev,
+						 const yaffs_Object *obj,
+						 int chunkId)
+{
+	__u32 hash = obj->objectId * 31 + chunkId;
+
+	return &dev->srCacheHash[hash & (dev->nSrCacheBuckets - 1)];
+}
+
+static void yaffs_SetChunkCacheDirty(yaffs_Device *dev,
+				     yaffs_ChunkCache *cache, int dirty)
+{
+	if (dirty && !cache->dirty)
+		dev->nDirtyCaches++;
+	else if (!dirty && cache->dirty)
+		dev->nDirtyCaches--;
+	cache->dirty = dirty;
+}
+
+/* Forget the chunk held by this cache and put it on the free list */
+static void yaffs_DropChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_SetChunkCacheDirty(dev, cache, 0);
+	cache->object = NULL;
+	ylist_del_init(&cache->hashLink);
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheFree);
+}
+
+/* Give the next entry without a buffer one, fails if we're at the limit
+ * or out of memory
+ */
+static int yaffs_GrowChunkCache(yaffs_Device *dev)
+{
+	yaffs_ChunkCache *cache;
+
+	if (dev->nSrCacheBuffers >= dev->param.nShortOpCaches)
+		return 0;
+
+	cache = &dev->srCache[dev->nSrCacheBuffers];
+	cache->data = YMALLOC_DMA(dev->param.totalBytesPerChunk);
+	if (!cache->data)
+		return 0;
+
+	dev->nSrCacheBuffers++;
+	ylist_add(&cache->lruLink, &dev->srCacheFree);
+	return 1;
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->param.nShortOpCaches;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
+	if (!dev->nDirtyCaches)
+		return 0;
+
+	ylist_for_each(i, &dev->srCacheLru) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
 		if (cache->object == obj &&
 		    cache->dirty)
 			return 1;
@@ -3198,53 +3481,58 @@ static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 }
 
 
+/* Write out all the dirty chunks of an object in chunk order, so that
+ * chunks written by separate short writes go to NAND together. The chunks
+ * stay in the cache, clean.
+ */
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
+	yaffs_ChunkCache **list = dev->srCacheFlush;
+	int nDirty = 0;
 	int chunkWritten = 0;
-	int nCaches = obj->myDev->param.nShortOpCaches;
+	int j, k;
 
-	if (nCaches > 0) {
-		do {
-			cache = NULL;
+	if (dev->param.nShortOpCaches <= 0 || !dev->nDirtyCaches)
+		return;
 
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
+	ylist_for_each(i, &dev->srCacheLru) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (cache->object != obj || !cache->dirty)
+			continue;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+		/* Insertion sort, there are usually only a few */
+		for (j = nDirty; j > 0 && list[j - 1]->chunkId > cache->chunkId; j--)
+			list[j] = list[j - 1];
+		list[j] = cache;
+		nDirty++;
+	}
 
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	for (k = 0; k < nDirty; k++) {
+		cache = list[k];
 
-		} while (cache && chunkWritten > 0);
+		/* Can't write out a cache that is in use */
+		if (cache->locked)
+			break;
 
-		if (cache) {
-			/* Hoosterman, disk full while writing cache out. */
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+		chunkWritten =
+		    yaffs_WriteChunkDataToObject(cache->object,
+						 cache->chunkId,
+						 cache->data,
+						 cache->nBytes,
+						 1);
+		if (chunkWritten <= 0)
+			break;
+		yaffs_SetChunkCacheDirty(dev, cache, 0);
+	}
+
+	if (k < nDirty) {
+		/* Hoosterman, disk full while writing cache out. */
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
 
-		}
 	}
 
 }
@@ -3257,96 +3545,81 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
 	yaffs_Object *obj;
-	int nCaches = dev->param.nShortOpCaches;
-	int i;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
+	int nDirty;
 
 	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
+	 * until there are no further dirty objects, or flushing stops
+	 * making progress.
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
-
+		nDirty = dev->nDirtyCaches;
+		ylist_for_each(i, &dev->srCacheLru) {
+			cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (cache->dirty && !cache->locked) {
+				obj = cache->object;
+				break;
+			}
 		}
 		if (obj)
 			yaffs_FlushFilesChunkCache(obj);
 
-	} while (obj);
+	} while (obj && dev->nDirtyCaches < nDirty);
 
 }
 
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+/* Grab us a cache chunk for use and set it up for this object and chunk.
+ * First look for a free one, then try to give another entry a buffer.
+ * Then take the least recently used one, writing out the dirty chunks
+ * of its object first if it is dirty.
  */
-static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
-{
-	int i;
-
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
-	}
-
-	return NULL;
-}
-
-static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
+static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev,
+					      yaffs_Object *obj, int chunkId)
 {
-	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
-
-	if (dev->param.nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_GrabChunkCacheWorker(dev);
+	yaffs_ChunkCache *cache = NULL;
+	struct ylist_head *i;
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+	if (dev->param.nShortOpCaches <= 0)
+		return NULL;
 
-			/* With locking we can't assume we can use entry zero */
+	if (ylist_empty(&dev->srCacheFree))
+		yaffs_GrowChunkCache(dev);
 
-			theObj = NULL;
-			usage = -1;
+	if (!ylist_empty(&dev->srCacheFree)) {
+		cache = ylist_entry(dev->srCacheFree.next, yaffs_ChunkCache,
+				    lruLink);
+	} else {
+		/* With locking we can't assume the oldest one is usable */
+		for (i = dev->srCacheLru.prev; i != &dev->srCacheLru;
+		     i = i->prev) {
+			cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (!cache->locked)
+				break;
 			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->param.nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
-			}
+		}
+		if (!cache)
+			return NULL;
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
-				cache = yaffs_GrabChunkCacheWorker(dev);
-			}
+		if (cache->dirty)
+			yaffs_FlushFilesChunkCache(cache->object);
+		if (cache->dirty)
+			return NULL;
+		ylist_del_init(&cache->hashLink);
+	}
 
-		}
-		return cache;
-	} else
-		return NULL;
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->nBytes = 0;
+	ylist_add(&cache->hashLink, yaffs_ChunkCacheBucket(dev, obj, chunkId));
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheLru);
 
+	return cache;
 }
 
 /* Find a cached chunk */
@@ -3354,15 +3627,15 @@ static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
 
-				return &dev->srCache[i];
-			}
+	if (dev->param.nShortOpCaches > 0) {
+		ylist_for_each(i, yaffs_ChunkCacheBucket(dev, obj, chunkId)) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId)
+				return cache;
 		}
 	}
 	return NULL;
@@ -3374,21 +3647,11 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 {
 
 	if (dev->param.nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
-
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
+		ylist_del(&cache->lruLink);
+		ylist_add(&cache->lruLink, &dev->srCacheLru);
 
 		if (isAWrite)
-			cache->dirty = 1;
+			yaffs_SetChunkCacheDirty(dev, cache, 1);
 	}
 }
 
@@ -3402,7 +3665,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_DropChunkCache(object->myDev, cache);
 	}
 }
 
@@ -3411,14 +3674,16 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
+	struct ylist_head *i, *n;
+	yaffs_ChunkCache *cache;
 	yaffs_Device *dev = in->myDev;
 
 	if (dev->param.nShortOpCaches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+		ylist_for_each_safe(i, n, &dev->srCacheLru) {
+			cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (cache->object == in)
+				yaffs_DropChunkCache(dev, cache);
 		}
 	}
 }
@@ -3470,22 +3735,25 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		 * else bypass the cache.
 		 */
 		if (cache || nToCopy != dev->nDataBytesPerChunk || dev->param.inbandTags) {
-			if (dev->param.nShortOpCaches > 0) {
+			if (cache) {
+				dev->cacheHits++;
+			} else if (dev->param.nShortOpCaches > 0) {
 
 				/* If we can't find the data in the cache, then load it up. */
 
-				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+				cache = yaffs_GrabChunkCache(dev, in, chunk);
+				if (cache) {
+					dev->cacheMisses++;
+					/* Keep cached readers off it until it is loaded */
+					cache->locked = 1;
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
-					cache->nBytes = 0;
+					cache->locked = 0;
 				}
+			}
 
+			if (cache) {
 				yaffs_UseChunkCache(dev, cache, 0);
 
 				cache->locked = 1;
@@ -3526,6 +3794,46 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	return nDone;
 }
 
+/* Read a range that is held entirely in the short op cache. This reads
+ * no NAND and changes nothing, not even the LRU order or the hit count,
+ * so several of these may run at once, and alongside a writer that is
+ * waiting on NAND. Entries still being loaded are locked and don't count.
+ * Returns the number of bytes read, or -1 if any part of the range is not
+ * cached, in which case the caller has to use yaffs_ReadDataFromFile().
+ */
+int yaffs_ReadDataFromCache(yaffs_Object *in, __u8 *buffer, loff_t offset,
+			int nBytes)
+{
+	int chunk;
+	__u32 start;
+	int nToCopy;
+	int n = nBytes;
+	yaffs_ChunkCache *cache;
+	yaffs_Device *dev = in->myDev;
+
+	while (n > 0) {
+		yaffs_AddrToChunk(dev, offset, &chunk, &start);
+		chunk++;
+
+		if ((start + n) < dev->nDataBytesPerChunk)
+			nToCopy = n;
+		else
+			nToCopy = dev->nDataBytesPerChunk - start;
+
+		cache = yaffs_FindChunkCache(in, chunk);
+		if (!cache || cache->locked)
+			return -1;
+
+		memcpy(buffer, &cache->data[start], nToCopy);
+
+		n -= nToCopy;
+		offset += nToCopy;
+		buffer += nToCopy;
+	}
+
+	return nBytes;
+}
+
 int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
@@ -3597,21 +3905,27 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			 */
 			if (dev->param.nShortOpCaches > 0) {
 				yaffs_ChunkCache *cache;
-				/* If we can't find the data in the cache, then load the cache */
+				/* If we can't find the data in the cache, then load the cache.
+				 * Dirty entries hold no allocated chunk yet, so the space check
+				 * must leave room for all of them as well as this one.
+				 */
 				cache = yaffs_FindChunkCache(in, chunk);
+				if (cache)
+					dev->cacheHits++;
 
 				if (!cache
-				    && yaffs_CheckSpaceForAllocation(dev, 1)) {
-					cache = yaffs_GrabChunkCache(dev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->data);
+				    && yaffs_CheckSpaceForAllocation(dev, dev->nDirtyCaches + 1)) {
+					cache = yaffs_GrabChunkCache(dev, in, chunk);
+					if (cache) {
+						dev->cacheMisses++;
+						cache->locked = 1;
+						yaffs_ReadChunkDataFromObject(in, chunk,
+									      cache->data);
+						cache->locked = 0;
+					}
 				} else if (cache &&
 					!cache->dirty &&
-					!yaffs_CheckSpaceForAllocation(dev, 1)) {
+					!yaffs_CheckSpaceForAllocation(dev, dev->nDirtyCaches + 1)) {
 					/* Drop the cache if it was a read cache item and
 					 * no space check has been made for it.
 					 */
@@ -3637,7 +3951,7 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 						     cache->chunkId,
 						     cache->data, cache->nBytes,
 						     1);
-						cache->dirty = 0;
+						yaffs_SetChunkCacheDirty(dev, cache, 0);
 					}
 
 				} else {
@@ -4052,9 +4366,11 @@ static int yaffs_UnlinkWorker(yaffs_Object *obj)
 		 * We can't really delete the object.
 		 * Instead, we do the following:
 		 * - Select a hardlink.
-		 * - Unhook it from the hard links
-		 * - Move it from its parent directory (so that the rename can work)
-		 * - Rename the object to the hardlink's name.
+		 * - Rename the object to the hardlink's name, forcing it in
+		 *   beside the hardlink so the name never goes missing for
+		 *   lookups that run while the header is written.
+		 * - Unhook the hardlink from the hard links
+		 * - Move it from its parent directory
 		 * - Delete the hardlink
 		 */
 
@@ -4068,14 +4384,13 @@ static int yaffs_UnlinkWorker(yaffs_Object *obj)
 		yaffs_GetObjectName(hl, name, YAFFS_MAX_NAME_LENGTH + 1);
 		parent = hl->parent;
 
-		ylist_del_init(&hl->hardLinks);
-
- 		yaffs_AddObjectToDirectory(obj->myDev->unlinkedDir, hl);
-
-		retVal = yaffs_ChangeObjectName(obj,parent, name, 0, 0);
+		retVal = yaffs_ChangeObjectName(obj, parent, name, 1, 0);
 
-		if (retVal == YAFFS_OK)
+		if (retVal == YAFFS_OK) {
+			ylist_del_init(&hl->hardLinks);
+			yaffs_AddObjectToDirectory(obj->myDev->unlinkedDir, hl);
 			retVal = yaffs_DoGenericObjectDeletion(hl);
+		}
 
 		return retVal;
 
@@ -4363,7 +4678,6 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 #endif
 
 	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -4395,6 +4709,9 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 				alloc_failed = 1; /* Not returned to caller */
 		}
 
+		/* Cleared last, lookups in RAM can run while the header is read */
+		in->lazyLoaded = 0;
+
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
 	}
 }
@@ -4479,6 +4796,9 @@ static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 
 
 	ylist_del_init(&obj->siblings);
+	ylist_del_init(&obj->nameLink);
+	if (parent)
+		parent->variant.directoryVariant.nChildren--;
 	obj->parent = NULL;
 	
 	yaffs_VerifyDirectory(parent);
@@ -4517,6 +4837,7 @@ void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	/* Now add it */
 	ylist_add(&obj->siblings, &directory->variant.directoryVariant.children);
 	obj->parent = directory;
+	yaffs_AddToNameHash(directory, obj);
 
 	if (directory == obj->myDev->unlinkedDir
 			|| directory == obj->myDev->deletedDir) {
@@ -4529,13 +4850,38 @@ void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	yaffs_VerifyObjectInDirectory(obj);
 }
 
+static int yaffs_ObjectHasName(yaffs_Object *directory, yaffs_Object *l,
+				const YCHAR *name, int sum, YCHAR *buffer)
+{
+	if (l->parent != directory)
+		YBUG();
+
+	yaffs_CheckObjectDetailsLoaded(l);
+
+	/* Special case for lost-n-found */
+	if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
+		if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0)
+			return 1;
+	} else if (yaffs_SumCompare(l->sum, sum) || l->hdrChunk <= 0) {
+		/* LostnFound chunk called Objxxx
+		 * Do a real check
+		 */
+		yaffs_GetObjectName(l, buffer,
+				    YAFFS_MAX_NAME_LENGTH + 1);
+		if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+			return 1;
+	}
+	return 0;
+}
+
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 				     const YCHAR *name)
 {
 	int sum;
 
-	struct ylist_head *i;
+	struct ylist_head *i, *n;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+	yaffs_DirectoryStructure *dS;
 
 	yaffs_Object *l;
 
@@ -4558,33 +4904,120 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 	}
 
 	sum = yaffs_CalcNameSum(name);
+	dS = &directory->variant.directoryVariant;
 
-	ylist_for_each(i, &directory->variant.directoryVariant.children) {
-		if (i) {
+	if (!dS->nameHash && dS->nChildren >= YAFFS_DIR_HASH_MIN_CHILDREN)
+		yaffs_BuildNameHash(directory);
+
+	if (!dS->nameHash) {
+		ylist_for_each(i, &dS->children) {
 			l = ylist_entry(i, yaffs_Object, siblings);
+			if (yaffs_ObjectHasName(directory, l, name, sum, buffer))
+				return l;
+		}
+		return NULL;
+	}
 
-			if (l->parent != directory)
-				YBUG();
+	/* Loading an object's details can move it to another bucket */
+	ylist_for_each_safe(i, n, &dS->nameHash[yaffs_CalcNameHash(name) &
+						(dS->nNameBuckets - 1)]) {
+		l = ylist_entry(i, yaffs_Object, nameLink);
+		if (yaffs_ObjectHasName(directory, l, name, sum, buffer))
+			return l;
+	}
+	ylist_for_each_safe(i, n, &dS->nameHash[dS->nNameBuckets]) {
+		l = ylist_entry(i, yaffs_Object, nameLink);
+		if (yaffs_ObjectHasName(directory, l, name, sum, buffer))
+			return l;
+	}
 
-			yaffs_CheckObjectDetailsLoaded(l);
+	return NULL;
+}
 
-			/* Special case for lost-n-found */
-			if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
-				if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0)
-					return l;
-			} else if (yaffs_SumCompare(l->sum, sum) || l->hdrChunk <= 0) {
-				/* LostnFound chunk called Objxxx
-				 * Do a real check
-				 */
-				yaffs_GetObjectName(l, buffer,
-						    YAFFS_MAX_NAME_LENGTH + 1);
-				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
-					return l;
+/* Does l have this name? 1 or 0, or -1 if the name is not in RAM. */
+static int yaffs_ObjectHasNameInRam(yaffs_Object *l, const YCHAR *name,
+				    int sum)
+{
+	if (l->lazyLoaded)
+		return -1;
+
+	if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND)
+		return yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0;
+
+	if (!yaffs_SumCompare(l->sum, sum) && l->hdrChunk > 0)
+		return 0;
+
+#ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
+	if (l->shortName[0])
+		return yaffs_strncmp(name, l->shortName,
+				     YAFFS_MAX_NAME_LENGTH) == 0;
+#endif
+	return -1;
+}
+
+/*
+ * yaffs_FindObjectByName() for callers that only hold the device shared.
+ * It only looks at names already in RAM and never loads an object or
+ * builds a name hash. Returns YAFFS_OK with *found set (possibly to NULL)
+ * if that was enough to answer, else YAFFS_FAIL and the caller has to
+ * repeat the lookup with the device held exclusively.
+ */
+int yaffs_FindObjectByNameInRam(yaffs_Object *directory, const YCHAR *name,
+				yaffs_Object **found)
+{
+	int sum;
+	int ret;
+	int bucket;
+	struct ylist_head *head;
+	struct ylist_head *i;
+	yaffs_DirectoryStructure *dS;
+	yaffs_Object *l;
+
+	*found = NULL;
+
+	if (!name || !directory ||
+	    directory->variantType != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return YAFFS_FAIL;
+
+	sum = yaffs_CalcNameSum(name);
+	dS = &directory->variant.directoryVariant;
+
+	if (!dS->nameHash) {
+		if (dS->nChildren >= YAFFS_DIR_HASH_MIN_CHILDREN)
+			return YAFFS_FAIL;
+		ylist_for_each(i, &dS->children) {
+			l = ylist_entry(i, yaffs_Object, siblings);
+			ret = yaffs_ObjectHasNameInRam(l, name, sum);
+			if (ret < 0)
+				return YAFFS_FAIL;
+			if (ret) {
+				*found = l;
+				return YAFFS_OK;
 			}
 		}
+		return YAFFS_OK;
 	}
 
-	return NULL;
+	for (bucket = 0; bucket < 2; bucket++) {
+		if (bucket == 0)
+			head = &dS->nameHash[yaffs_CalcNameHash(name) &
+					     (dS->nNameBuckets - 1)];
+		else
+			head = &dS->nameHash[dS->nNameBuckets];
+
+		ylist_for_each(i, head) {
+			l = ylist_entry(i, yaffs_Object, nameLink);
+			ret = yaffs_ObjectHasNameInRam(l, name, sum);
+			if (ret < 0)
+				return YAFFS_FAIL;
+			if (ret) {
+				*found = l;
+				return YAFFS_OK;
+			}
+		}
+	}
+
+	return YAFFS_OK;
 }
 
 
@@ -5270,7 +5703,6 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->passiveGCs = 0;
 	dev->oldestDirtyGCs = 0;
 	dev->backgroundGCs = 0;
-	dev->gcBlockFinder = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
 	dev->nDeletedFiles = 0;
@@ -5296,35 +5728,53 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->gcCleanupList = NULL;
 
 
+	dev->srCacheHash = NULL;
+	dev->srCacheFlush = NULL;
+	dev->nSrCacheBuffers = 0;
+	dev->nDirtyCaches = 0;
+	YINIT_LIST_HEAD(&dev->srCacheLru);
+	YINIT_LIST_HEAD(&dev->srCacheFree);
+
 	if (!init_failed &&
 	    dev->param.nShortOpCaches > 0) {
 		int i;
-		void *buf;
-		int srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
 
 		if (dev->param.nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
+		srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
 
-		dev->srCache =  YMALLOC(srCacheBytes);
+		for (dev->nSrCacheBuckets = 1;
+		     dev->nSrCacheBuckets < dev->param.nShortOpCaches;
+		     dev->nSrCacheBuckets <<= 1)
+			;
 
-		buf = (__u8 *) dev->srCache;
+		dev->srCache =  YMALLOC(srCacheBytes);
+		dev->srCacheHash = YMALLOC(dev->nSrCacheBuckets *
+					   sizeof(struct ylist_head));
+		dev->srCacheFlush = YMALLOC(dev->param.nShortOpCaches *
+					    sizeof(yaffs_ChunkCache *));
 
-		if (dev->srCache)
+		if (dev->srCache && dev->srCacheHash && dev->srCacheFlush) {
 			memset(dev->srCache, 0, srCacheBytes);
+			for (i = 0; i < dev->param.nShortOpCaches; i++) {
+				YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+				YINIT_LIST_HEAD(&dev->srCache[i].lruLink);
+			}
+			for (i = 0; i < dev->nSrCacheBuckets; i++)
+				YINIT_LIST_HEAD(&dev->srCacheHash[i]);
 
-		for (i = 0; i < dev->param.nShortOpCaches && buf; i++) {
-			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
-			dev->srCache[i].dirty = 0;
-			dev->srCache[i].data = buf = YMALLOC_DMA(dev->param.totalBytesPerChunk);
+			/* The rest get their buffers as the cache fills up */
+			while (dev->nSrCacheBuffers < YAFFS_MIN_SHORT_OP_CACHES &&
+			       yaffs_GrowChunkCache(dev))
+				;
 		}
-		if (!buf)
+		if (!dev->nSrCacheBuffers)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->param.nChunksPerBlock * sizeof(__u32));
@@ -5386,6 +5836,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		yaffs_FixHangingObjects(dev);
 		if(dev->param.emptyLostAndFound)
 			yaffs_EmptyLostAndFound(dev);
+		yaffs_RebuildGCQueue(dev);
 	}
 
 	if (init_failed) {
@@ -5402,6 +5853,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->nPageWrites = 0;
 	dev->nBlockErasures = 0;
 	dev->nGCCopies = 0;
+	dev->foregroundGCs = 0;
+	dev->foregroundGCCopies = 0;
 	dev->nRetriedWrites = 0;
 
 	dev->nRetiredBlocks = 0;
@@ -5429,15 +5882,22 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 		if (dev->param.nShortOpCaches > 0 &&
 		    dev->srCache) {
 
-			for (i = 0; i < dev->param.nShortOpCaches; i++) {
+			for (i = 0; i < dev->nSrCacheBuffers; i++) {
 				if (dev->srCache[i].data)
 					YFREE(dev->srCache[i].data);
 				dev->srCache[i].data = NULL;
 			}
+			dev->nSrCacheBuffers = 0;
 
 			YFREE(dev->srCache);
 			dev->srCache = NULL;
 		}
+		if (dev->srCacheHash)
+			YFREE(dev->srCacheHash);
+		dev->srCacheHash = NULL;
+		if (dev->srCacheFlush)
+			YFREE(dev->srCacheFlush);
+		dev->srCacheFlush = NULL;
 
 		YFREE(dev->gcCleanupList);
 
@@ -5483,9 +5943,7 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	/* This is what we report to the outside world */
 
 	int nFree;
-	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -5495,14 +5953,9 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	nFree += dev->nDeletedFiles;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->param.nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
+	/* Now subtract the dirty chunks in the cache */
 
-	nFree -= nDirtyCacheChunks;
+	nFree -= dev->nDirtyCaches;
 
 	nFree -= ((dev->param.nReservedBlocks + 1) * dev->param.nChunksPerBlock);
 
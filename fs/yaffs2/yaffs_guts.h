@@ -60,6 +60,11 @@
 
 #define YAFFS_NOBJECT_BUCKETS		256
 
+/* Directories with this many children get hashed by name on lookup */
+#define YAFFS_DIR_HASH_MIN_CHILDREN	32
+/* Children per name hash bucket before the hash is rebuilt bigger */
+#define YAFFS_DIR_HASH_MAX_LOAD		4
+
 
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE -1)
@@ -88,7 +93,10 @@
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
+/* Short op caches that get their buffers at mount, the rest are
+ * allocated as the cache fills */
+#define YAFFS_MIN_SHORT_OP_CACHES	10
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -115,7 +123,8 @@
 typedef struct {
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
+	struct ylist_head hashLink;	/* entry in the device's cache hash */
+	struct ylist_head lruLink;	/* entry in the LRU list, or the free list */
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -377,6 +386,12 @@ typedef struct {
 typedef struct {
 	struct ylist_head children;     /* list of child links */
 	struct ylist_head dirty;	/* Entry for list of dirty directories */
+	int nChildren;
+	/* Children by name hash, NULL until a lookup builds it. There is an
+	 * extra bucket at the end for children whose name is not known.
+	 */
+	struct ylist_head *nameHash;
+	int nNameBuckets;
 } yaffs_DirectoryStructure;
 
 typedef struct {
@@ -434,6 +449,8 @@ struct yaffs_ObjectStruct {
 	/* also used for linking up the free list */
 	struct yaffs_ObjectStruct *parent;
 	struct ylist_head siblings;
+	struct ylist_head nameLink;	/* entry in the parent's name hash */
+	__u32 nameHash;		/* hash of the full name, 0 if not known */
 
 	/* Where's my object header in NAND? */
 	int hdrChunk;
@@ -534,8 +551,9 @@ struct yaffs_DeviceParamStruct {
 
 
 	int nShortOpCaches;	/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-                                 * 10 to 20 is a good bet.
+				 * the most short op caches that will be used.
+				 * Up to YAFFS_MAX_SHORT_OP_CACHES, they are
+				 * hashed so a few hundred is fine.
 				 */
 	int useNANDECC;		/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int noTagsECC;		/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */ 
@@ -590,6 +608,12 @@ struct yaffs_DeviceParamStruct {
 	/*  Callback to control garbage collection. */
 	unsigned (*gcControl)(struct yaffs_DeviceStruct *dev);
 
+	/* Callbacks around each NAND access. Linux uses them to let lookups
+	 * and cached reads in while the device waits on the flash.
+	 */
+	void (*nandAccessBegin)(struct yaffs_DeviceStruct *dev);
+	void (*nandAccessEnd)(struct yaffs_DeviceStruct *dev);
+
         /* Debug control flags. Don't use unless you know what you're doing */
 	int useHeaderFileSize;	/* Flag to determine if we should use file sizes from the header */
 	int disableLazyLoad;	/* Disable lazy loading on this device */
@@ -698,7 +722,8 @@ struct yaffs_DeviceStruct {
 
 	unsigned hasPendingPrioritisedGCs; /* We think this device might have pending prioritised gcs */
 	unsigned gcDisable;
-	unsigned gcBlockFinder;
+	struct ylist_head *gcQueue;	/* full blocks by pages in use */
+	struct ylist_head *gcQueueLinks; /* one per block */
 	unsigned gcDirtiest;
 	unsigned gcPagesInUse;
 	unsigned gcNotDone;
@@ -719,7 +744,13 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	int nSrCacheBuffers;		/* srCache entries with a data buffer */
+	struct ylist_head srCacheLru;	/* cached chunks, most recently used first */
+	struct ylist_head srCacheFree;	/* entries with a buffer but no chunk */
+	struct ylist_head *srCacheHash;
+	int nSrCacheBuckets;
+	int nDirtyCaches;
+	yaffs_ChunkCache **srCacheFlush; /* for writing out in chunk order */
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -759,6 +790,8 @@ struct yaffs_DeviceStruct {
 	__u32 oldestDirtyGCs;
 	__u32 nGCBlocks;
 	__u32 backgroundGCs;
+	__u32 foregroundGCs;	/* GCs done on behalf of a writer */
+	__u32 foregroundGCCopies;
 	__u32 nRetriedWrites;
 	__u32 nRetiredBlocks;
 	__u32 eccFixed;
@@ -769,6 +802,7 @@ struct yaffs_DeviceStruct {
 	__u32 nUnmarkedDeletions;
 	__u32 refreshCount;
 	__u32 cacheHits;
+	__u32 cacheMisses;
 
 };
 
@@ -855,6 +889,8 @@ int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 /* File operations */
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
+int yaffs_ReadDataFromCache(yaffs_Object *obj, __u8 *buffer, loff_t offset,
+				int nBytes);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
 				int nBytes, int writeThrough);
 int yaffs_ResizeFile(yaffs_Object *obj, loff_t newSize);
@@ -874,6 +910,8 @@ int yaffs_CheckpointRestore(yaffs_Device *dev);
 yaffs_Object *yaffs_MknodDirectory(yaffs_Object *parent, const YCHAR *name,
 				__u32 mode, __u32 uid, __u32 gid);
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *theDir, const YCHAR *name);
+int yaffs_FindObjectByNameInRam(yaffs_Object *theDir, const YCHAR *name,
+				yaffs_Object **found);
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
 				   int (*fn) (yaffs_Object *));
 
@@ -26,6 +26,10 @@ struct yaffs_LinuxContext {
 	struct task_struct *bgThread; /* Background thread for this device */
 	int bgRunning;
         struct semaphore grossLock;     /* Gross locking semaphore */
+	struct rw_semaphore stateLock;	/* Guards the RAM state lookups and
+					 * cached reads use, see yaffs_GrossLock() */
+	struct task_struct *stateOwner;	/* Holder of the gross lock */
+	int stateYielded;		/* It dropped stateLock for NAND access */
 	__u8 *spareBuffer;      /* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
@@ -34,6 +38,17 @@ struct yaffs_LinuxContext {
 
 	struct task_struct *readdirProcess;
 	unsigned mount_id;
+
+	/* Write rate tracking for the background GC forecast */
+	unsigned long bgSampleTime;
+	__u32 bgSampleWrites;
+	unsigned bgWriteRate;		/* chunks per second, smoothed */
+	unsigned long bgLastWrite;	/* when writes were last seen */
+
+	/* Writes that had to wait for garbage collection */
+	__u32 gcStalls;
+	unsigned long gcStallJiffies;
+	unsigned long gcStallMaxJiffies;
 };
 
 #define yaffs_DeviceToLC(dev) ((struct yaffs_LinuxContext *)((dev)->osContext))
@@ -17,6 +17,18 @@
 
 #include "yaffs_getblockinfo.h"
 
+void yaffs_NANDAccessBegin(yaffs_Device *dev)
+{
+	if (dev->param.nandAccessBegin)
+		dev->param.nandAccessBegin(dev);
+}
+
+void yaffs_NANDAccessEnd(yaffs_Device *dev)
+{
+	if (dev->param.nandAccessEnd)
+		dev->param.nandAccessEnd(dev);
+}
+
 int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 					   __u8 *buffer,
 					   yaffs_ExtendedTags *tags)
@@ -32,6 +44,7 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	if (!tags)
 		tags = &localTags;
 
+	yaffs_NANDAccessBegin(dev);
 	if (dev->param.readChunkWithTagsFromNAND)
 		result = dev->param.readChunkWithTagsFromNAND(dev, realignedChunkInNAND, buffer,
 						      tags);
@@ -40,6 +53,8 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 									realignedChunkInNAND,
 									buffer,
 									tags);
+	yaffs_NANDAccessEnd(dev);
+
 	if (tags &&
 	   tags->eccResult > YAFFS_ECC_RESULT_NO_ERROR) {
 
@@ -56,6 +71,7 @@ int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   const __u8 *buffer,
 						   yaffs_ExtendedTags *tags)
 {
+	int result;
 
 	dev->nPageWrites++;
 
@@ -78,14 +94,18 @@ int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 		YBUG();
 	}
 
+	yaffs_NANDAccessBegin(dev);
 	if (dev->param.writeChunkWithTagsToNAND)
-		return dev->param.writeChunkWithTagsToNAND(dev, chunkInNAND, buffer,
+		result = dev->param.writeChunkWithTagsToNAND(dev, chunkInNAND, buffer,
 						     tags);
 	else
-		return yaffs_TagsCompatabilityWriteChunkWithTagsToNAND(dev,
+		result = yaffs_TagsCompatabilityWriteChunkWithTagsToNAND(dev,
 								       chunkInNAND,
 								       buffer,
 								       tags);
+	yaffs_NANDAccessEnd(dev);
+
+	return result;
 }
 
 int yaffs_MarkBlockBad(yaffs_Device *dev, int blockNo)
@@ -124,7 +144,9 @@ int yaffs_EraseBlockInNAND(struct yaffs_DeviceStruct *dev,
 
 	dev->nBlockErasures++;
 
+	yaffs_NANDAccessBegin(dev);
 	result = dev->param.eraseBlockInNAND(dev, blockInNAND);
+	yaffs_NANDAccessEnd(dev);
 
 	return result;
 }
@@ -18,6 +18,8 @@
 #include "yaffs_guts.h"
 
 
+void yaffs_NANDAccessBegin(yaffs_Device *dev);
+void yaffs_NANDAccessEnd(yaffs_Device *dev);
 
 int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 					__u8 *buffer,
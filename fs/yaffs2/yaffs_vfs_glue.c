@@ -78,6 +78,7 @@
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/swap.h>
 
 #if (YAFFS_NEW_FOLLOW_LINK == 1)
 #include <linux/namei.h>
@@ -175,6 +176,11 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+/* Background GC hurries up when erased space is forecast to run out
+ * within this many seconds, and goes flat out within a fifth of it. */
+unsigned int yaffs_bg_forecast_secs = 30;
+/* Writes must have stopped for this long for the device to count as idle */
+unsigned int yaffs_bg_idle_ms = 500;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -183,6 +189,8 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_forecast_secs, uint, 0644);
+module_param(yaffs_bg_idle_ms, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -512,17 +520,103 @@ static unsigned yaffs_gc_control_callback(yaffs_Device *dev)
 	return yaffs_gc_control;
 }
                 	                                                                                          	
+/*
+ * The gross lock serializes everything that changes the device: writes,
+ * allocation, GC, checkpointing and all NAND access. Its holder also holds
+ * stateLock for writing, which covers the RAM state the shared paths look
+ * at (the object tree, names and the short op cache), but drops it for as
+ * long as each NAND access takes. See yaffs_nand_begin_callback().
+ */
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
+	struct yaffs_LinuxContext *lc = yaffs_DeviceToLC(dev);
+
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking %p\n"), current));
-	down(&(yaffs_DeviceToLC(dev)->grossLock));
+	down(&lc->grossLock);
+	down_write(&lc->stateLock);
+	lc->stateOwner = current;
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked %p\n"), current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
+	struct yaffs_LinuxContext *lc = yaffs_DeviceToLC(dev);
+
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking %p\n"), current));
-	up(&(yaffs_DeviceToLC(dev)->grossLock));
+	lc->stateOwner = NULL;
+	up_write(&lc->stateLock);
+	up(&lc->grossLock);
+}
+
+/*
+ * The shared side is for paths that neither touch NAND nor change
+ * anything: lookups of names held in RAM, symlink reads and reads of
+ * chunks sitting in the short op cache. They only take stateLock, so they
+ * run alongside each other and alongside a gross lock holder that is
+ * waiting on the flash. Space queries are not among them:
+ * yaffs_GetNumberOfFreeChunks() caches the checkpoint size in the device.
+ */
+static void yaffs_GrossLockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking shared %p\n"), current));
+	down_read(&(yaffs_DeviceToLC(dev)->stateLock));
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked shared %p\n"), current));
+}
+
+static void yaffs_GrossUnlockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking shared %p\n"), current));
+	up_read(&(yaffs_DeviceToLC(dev)->stateLock));
+}
+
+/*
+ * Called by yaffs_guts around each NAND access. The gross lock holder lets
+ * go of the RAM state while the flash is busy; the gross lock itself stays
+ * held so no other writer gets in. Accesses made without the gross lock,
+ * ie. while mounting, are left alone.
+ */
+static void yaffs_nand_begin_callback(yaffs_Device *dev)
+{
+	struct yaffs_LinuxContext *lc = yaffs_DeviceToLC(dev);
+
+	if (lc->stateOwner == current) {
+		lc->stateYielded = 1;
+		up_write(&lc->stateLock);
+	}
+}
+
+static void yaffs_nand_end_callback(yaffs_Device *dev)
+{
+	struct yaffs_LinuxContext *lc = yaffs_DeviceToLC(dev);
+
+	if (lc->stateOwner == current && lc->stateYielded) {
+		down_write(&lc->stateLock);
+		lc->stateYielded = 0;
+	}
+}
+
+/* Would looking at obj load a header, ie. it is a hardlink to a lazy one? */
+static int yaffs_NeedsLoading(yaffs_Object *obj)
+{
+	return obj->variantType == YAFFS_OBJECT_TYPE_HARDLINK &&
+		obj->variant.hardLinkVariant.equivalentObject->lazyLoaded;
+}
+
+/* Account a write that started at 'start' if it had to garbage collect */
+static void yaffs_NoteGCStall(yaffs_Device *dev, __u32 foregroundGCs,
+				unsigned long start)
+{
+	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
+	unsigned long stall;
+
+	if (dev->foregroundGCs == foregroundGCs)
+		return;
+
+	stall = jiffies - start;
+	context->gcStalls++;
+	context->gcStallJiffies += stall;
+	if (stall > context->gcStallMaxJiffies)
+		context->gcStallMaxJiffies = stall;
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -706,19 +800,33 @@ static void yaffs_RemoveObjectCallback(yaffs_Object *obj)
 
 /*-----------------------------------------------------------------*/
 
-static int yaffs_readlink(struct dentry *dentry, char __user *buffer,
-			int buflen)
+static unsigned char *yaffs_ReadSymlinkAlias(yaffs_Object *obj)
 {
 	unsigned char *alias;
-	int ret;
+	yaffs_Device *dev = obj->myDev;
 
-	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
+	yaffs_GrossLockShared(dev);
+	if (!yaffs_NeedsLoading(obj)) {
+		alias = yaffs_GetSymlinkAlias(obj);
+		yaffs_GrossUnlockShared(dev);
+		return alias;
+	}
+	yaffs_GrossUnlockShared(dev);
 
 	yaffs_GrossLock(dev);
+	alias = yaffs_GetSymlinkAlias(obj);
+	yaffs_GrossUnlock(dev);
 
-	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
+	return alias;
+}
 
-	yaffs_GrossUnlock(dev);
+static int yaffs_readlink(struct dentry *dentry, char __user *buffer,
+			int buflen)
+{
+	unsigned char *alias;
+	int ret;
+
+	alias = yaffs_ReadSymlinkAlias(yaffs_DentryToObject(dentry));
 
 	if (!alias)
 		return -ENOMEM;
@@ -736,12 +844,8 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 {
 	unsigned char *alias;
 	int ret;
-	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
-
-	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
-	yaffs_GrossUnlock(dev);
+	alias = yaffs_ReadSymlinkAlias(yaffs_DentryToObject(dentry));
 
 	if (!alias) {
 		ret = -ENOMEM;
@@ -785,22 +889,38 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	struct inode *inode = NULL;	/* NCB 2.5/2.6 needs NULL here */
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
-
-	if(current != yaffs_DeviceToLC(dev)->readdirProcess)
-		yaffs_GrossLock(dev);
+	int inReaddir = (current == yaffs_DeviceToLC(dev)->readdirProcess);
+	int found = YAFFS_FAIL;
 
 	T(YAFFS_TRACE_OS,
 		(TSTR("yaffs_lookup for %d:%s\n"),
 		yaffs_InodeToObject(dir)->objectId, dentry->d_name.name));
 
-	obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
-					dentry->d_name.name);
+	/* Try names already in RAM first, alongside other lookups */
+	if (!inReaddir) {
+		yaffs_GrossLockShared(dev);
+		found = yaffs_FindObjectByNameInRam(yaffs_InodeToObject(dir),
+						dentry->d_name.name, &obj);
+		if (found == YAFFS_OK && obj && yaffs_NeedsLoading(obj))
+			found = YAFFS_FAIL;
+		if (found == YAFFS_OK)
+			obj = yaffs_GetEquivalentObject(obj);
+		yaffs_GrossUnlockShared(dev);
+	}
+
+	if (found != YAFFS_OK) {
+		if (!inReaddir)
+			yaffs_GrossLock(dev);
 
-	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
+		obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
+						dentry->d_name.name);
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
-	if(current != yaffs_DeviceToLC(dev)->readdirProcess)
-		yaffs_GrossUnlock(dev);
+		obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
+
+		/* Can't hold gross lock when calling yaffs_get_inode() */
+		if (!inReaddir)
+			yaffs_GrossUnlock(dev);
+	}
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -1014,13 +1134,23 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
+	ret = yaffs_ReadDataFromCache(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
+
+	if (ret < 0) {
+		yaffs_GrossLock(dev);
+
+		ret = yaffs_ReadDataFromFile(obj, pg_buf,
+					pg->index << PAGE_CACHE_SHIFT,
+					PAGE_CACHE_SIZE);
+
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -1074,6 +1204,8 @@ static int yaffs_writepage(struct page *page)
 	int nWritten = 0;
 	unsigned nBytes;
 	loff_t i_size;
+	__u32 foregroundGCs;
+	unsigned long start;
 
 	if (!mapping)
 		BUG();
@@ -1123,9 +1255,14 @@ static int yaffs_writepage(struct page *page)
 		(TSTR("writepag0: obj = %05x, ino = %05x\n"),
 		(int)obj->variant.fileVariant.fileSize, (int)inode->i_size));
 
+	foregroundGCs = dev->foregroundGCs;
+	start = jiffies;
+
 	nWritten = yaffs_WriteDataToFile(obj, buffer,
 			page->index << PAGE_CACHE_SHIFT, nBytes, 0);
 
+	yaffs_NoteGCStall(dev, foregroundGCs, start);
+
 	yaffs_MarkSuperBlockDirty(dev);
 
 	T(YAFFS_TRACE_OS,
@@ -1443,6 +1580,8 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 	int nWritten, ipos;
 	struct inode *inode;
 	yaffs_Device *dev;
+	__u32 foregroundGCs;
+	unsigned long start;
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
@@ -1466,8 +1605,13 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 			"to object %d at %d(%x)\n"),
 			(unsigned) n, (unsigned) n, obj->objectId, ipos,ipos));
 
+	foregroundGCs = dev->foregroundGCs;
+	start = jiffies;
+
 	nWritten = yaffs_WriteDataToFile(obj, buf, ipos, n, 0);
 
+	yaffs_NoteGCStall(dev, foregroundGCs, start);
+
 	yaffs_MarkSuperBlockDirty(dev);
 
 	T(YAFFS_TRACE_OS,
@@ -2240,11 +2384,55 @@ static void yaffs_FlushSuperBlock(struct super_block *sb, int do_checkpoint)
 }
 
 
+/*
+ * Sample how fast foreground writes are using up chunks. GC copies are
+ * left out since they come from the background thread or from writers
+ * that are already stalled.
+ */
+static void yaffs_bg_sample(yaffs_Device *dev)
+{
+	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
+	unsigned long now = jiffies;
+	unsigned long elapsed = now - context->bgSampleTime;
+	__u32 writes = dev->nPageWrites - dev->nGCCopies;
+	__u32 delta = writes - context->bgSampleWrites;
+	unsigned rate;
+
+	if (elapsed < HZ / 10)
+		return;
+
+	rate = elapsed < 60 * HZ ? (delta * HZ) / elapsed : 0;
+	context->bgWriteRate = (context->bgWriteRate * 3 + rate) / 4;
+	context->bgSampleTime = now;
+	context->bgSampleWrites = writes;
+	if (delta)
+		context->bgLastWrite = now;
+}
+
+static int yaffs_bg_idle(yaffs_Device *dev)
+{
+	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
+
+	return time_after(jiffies, context->bgLastWrite +
+			msecs_to_jiffies(yaffs_bg_idle_ms));
+}
+
+/*
+ * How hard the background thread should collect. The forecast divides
+ * the erased space left above the reserve by the recent write rate; if
+ * that runs out soon we collect regardless. Otherwise the dirtiness of
+ * the device decides, but while writers are busy only the most urgent
+ * case is acted on and the rest waits for an idle window.
+ */
 static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 {
 	unsigned erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
 	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
 	unsigned scatteredFree = 0; /* Free chunks not in an erased block */
+	unsigned reserve = (dev->param.nReservedBlocks + 1) *
+				dev->param.nChunksPerBlock;
+	unsigned forecast = 0;
+	unsigned urgency;
 
 	if(erasedChunks < dev->nFreeChunks)
 		scatteredFree = (dev->nFreeChunks - erasedChunks);
@@ -2253,12 +2441,30 @@ static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 		return 0;
 	else if(scatteredFree < (dev->param.nChunksPerBlock * 2))
 		return 0;
-	else if(erasedChunks > dev->nFreeChunks/2)
-		return 0;
+
+	if(erasedChunks <= reserve)
+		forecast = 2;
+	else if(context->bgWriteRate) {
+		unsigned secsLeft = (erasedChunks - reserve) /
+					context->bgWriteRate;
+
+		if(secsLeft < yaffs_bg_forecast_secs / 5)
+			forecast = 2;
+		else if(secsLeft < yaffs_bg_forecast_secs)
+			forecast = 1;
+	}
+
+	if(erasedChunks > dev->nFreeChunks/2)
+		urgency = 0;
 	else if(erasedChunks > dev->nFreeChunks/4)
-		return 1;
+		urgency = 1;
 	else
-		return 2;
+		urgency = 2;
+
+	if(urgency < 2 && !yaffs_bg_idle(dev))
+		urgency = 0;
+
+	return forecast > urgency ? forecast : urgency;
 }
 
 static int yaffs_do_sync_fs(struct super_block *sb,
@@ -2321,6 +2527,7 @@ static int yaffs_BackgroundThread(void *data)
 	unsigned long next_gc = now;
 	unsigned long expires;
 	unsigned int urgency;
+	__u32 gcBlocks;
 
 	int gcResult;
 	struct timer_list timer;
@@ -2352,11 +2559,22 @@ static int yaffs_BackgroundThread(void *data)
 			next_dir_update = now + HZ;
 		}
 
+		yaffs_bg_sample(dev);
+
 		if(time_after(now,next_gc) && yaffs_bg_enable){
 			if(!dev->isCheckpointed){
+				gcBlocks = dev->backgroundGCs;
 				urgency = yaffs_bg_gc_urgency(dev);
 				gcResult = yaffs_BackgroundGarbageCollect(dev, urgency);
-				if(urgency > 1)
+				/*
+				 * Only go back to back while passes are still
+				 * selecting blocks; otherwise an idle device
+				 * with nothing to collect would wake every jiffy.
+				 */
+				if(urgency > 0 && yaffs_bg_idle(dev) &&
+				   dev->backgroundGCs != gcBlocks)
+					next_gc = now + 1; /* make use of the quiet */
+				else if(urgency > 1)
 					next_gc = now + HZ/20+1;
 				else if(urgency > 0)
 					next_gc = now + HZ/10+1;
@@ -2402,6 +2620,9 @@ static int yaffs_BackgroundStart(yaffs_Device *dev)
 		return -1;
 
 	context->bgRunning = 1;
+	context->bgSampleTime = jiffies;
+	context->bgSampleWrites = dev->nPageWrites - dev->nGCCopies;
+	context->bgLastWrite = jiffies;
 
 	context->bgThread = kthread_run(yaffs_BackgroundThread,
 	                        (void *)dev,"yaffs-bg-%d",context->mount_id);
@@ -2677,6 +2898,26 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 	return error;
 }
 
+/* The short op cache may grow to this share of the memory that is free at
+ * mount. It only takes the memory as it fills up.
+ */
+#define YAFFS_SHORT_OP_CACHE_MEM_SHARE	256
+
+static int yaffs_ShortOpCachesFor(yaffs_DeviceParam *param)
+{
+	unsigned long bytes;
+	int nCaches;
+
+	bytes = nr_free_pages() / YAFFS_SHORT_OP_CACHE_MEM_SHARE * PAGE_SIZE;
+	nCaches = bytes / param->totalBytesPerChunk;
+
+	if (nCaches < YAFFS_MIN_SHORT_OP_CACHES)
+		nCaches = YAFFS_MIN_SHORT_OP_CACHES;
+	if (nCaches > YAFFS_MAX_SHORT_OP_CACHES)
+		nCaches = YAFFS_MAX_SHORT_OP_CACHES;
+	return nCaches;
+}
+
 static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 						struct super_block *sb,
 						void *data, int silent)
@@ -2997,10 +3238,15 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	param->eraseBlockInNAND = nandmtd_EraseBlockInNAND;
 	param->initialiseNAND = nandmtd_InitialiseNAND;
 
+	if (!options.no_cache)
+		param->nShortOpCaches = yaffs_ShortOpCachesFor(param);
+
 	yaffs_DeviceToLC(dev)->putSuperFunc = yaffs_MTDPutSuper;
 
 	param->markSuperBlockDirty = yaffs_MarkSuperBlockDirty;
 	param->gcControl = yaffs_gc_control_callback;
+	param->nandAccessBegin = yaffs_nand_begin_callback;
+	param->nandAccessEnd = yaffs_nand_end_callback;
 
 	yaffs_DeviceToLC(dev)->superBlock= sb;
 	
@@ -3037,6 +3283,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         param->removeObjectCallback = yaffs_RemoveObjectCallback;
 
 	init_MUTEX(&(yaffs_DeviceToLC(dev)->grossLock));
+	init_rwsem(&(yaffs_DeviceToLC(dev)->stateLock));
 
 	yaffs_GrossLock(dev);
 
@@ -3207,8 +3454,22 @@ static char *yaffs_dump_dev_part0(char *buf, yaffs_Device * dev)
 }
 
 
+static unsigned yaffs_CacheHitRate(yaffs_Device *dev)
+{
+	__u64 hits = dev->cacheHits;
+	__u32 total = dev->cacheHits + dev->cacheMisses;
+
+	if (!total)
+		return 0;
+	hits *= 100;
+	do_div(hits, total);
+	return (unsigned)hits;
+}
+
 static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 {
+	struct yaffs_LinuxContext *lc = yaffs_DeviceToLC(dev);
+
 	buf += sprintf(buf, "nDataBytesPerChunk. %d\n", dev->nDataBytesPerChunk);
 	buf += sprintf(buf, "chunkGroupBits..... %d\n", dev->chunkGroupBits);
 	buf += sprintf(buf, "chunkGroupSize..... %d\n", dev->chunkGroupSize);
@@ -3228,6 +3489,14 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "oldestDirtyGCs..... %u\n", dev->oldestDirtyGCs);
 	buf += sprintf(buf, "nGCBlocks.......... %u\n", dev->nGCBlocks);
 	buf += sprintf(buf, "backgroundGCs...... %u\n", dev->backgroundGCs);
+	buf += sprintf(buf, "foregroundGCs...... %u\n", dev->foregroundGCs);
+	buf += sprintf(buf, "foregroundGCCopies. %u\n", dev->foregroundGCCopies);
+	buf += sprintf(buf, "gcStalls........... %u\n", lc->gcStalls);
+	buf += sprintf(buf, "gcStallTotalMs..... %u\n",
+			jiffies_to_msecs(lc->gcStallJiffies));
+	buf += sprintf(buf, "gcStallMaxMs....... %u\n",
+			jiffies_to_msecs(lc->gcStallMaxJiffies));
+	buf += sprintf(buf, "bgWriteRate........ %u\n", lc->bgWriteRate);
 	buf += sprintf(buf, "nRetriedWrites..... %u\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nRetireBlocks...... %u\n", dev->nRetiredBlocks);
 	buf += sprintf(buf, "eccFixed........... %u\n", dev->eccFixed);
@@ -3235,6 +3504,10 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %u\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %u\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %u\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %u\n", dev->cacheMisses);
+	buf += sprintf(buf, "cacheHitRate....... %u%%\n", yaffs_CacheHitRate(dev));
+	buf += sprintf(buf, "nCacheBuffers...... %d\n", dev->nSrCacheBuffers);
+	buf += sprintf(buf, "nDirtyCaches....... %d\n", dev->nDirtyCaches);
 	buf += sprintf(buf, "nDeletedFiles...... %u\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %u\n", dev->nUnlinkedFiles);
 	buf += sprintf(buf, "refreshCount....... %u\n", dev->refreshCount);
@@ -61,6 +61,10 @@
 
 #define PMEM_GET_FREE_SPACE	_IOW(PMEM_IOCTL_MAGIC, 14, unsigned int)
 #define PMEM_ALLOCATE_ALIGNED	_IOW(PMEM_IOCTL_MAGIC, 15, unsigned int)
+/* Like PMEM_ALLOCATE, but the driver may move the allocation to make room
+ * for others until the file is mmaped, connected to or its address is
+ * asked for */
+#define PMEM_ALLOCATE_MOVABLE	_IOW(PMEM_IOCTL_MAGIC, 16, unsigned int)
 struct pmem_region {
 	unsigned long offset;
 	unsigned long len;
@@ -84,6 +84,17 @@ struct mmc_host_ops {
 	int (*enable)(struct mmc_host *host);
 	int (*disable)(struct mmc_host *host, int lazy);
 	void	(*request)(struct mmc_host *host, struct mmc_request *req);
+	/*
+	 * Optional hooks to do the per-request data work that does not need
+	 * the controller, such as DMA mapping and cache maintenance, ahead of
+	 * time. 'pre_req' may be called for one request while another is
+	 * still running on the host; 'post_req' undoes it once the request
+	 * has completed (or was never issued, with 'err' set). Hosts keep
+	 * their state in mmc_data->host_cookie, which is zero otherwise.
+	 */
+	void	(*pre_req)(struct mmc_host *host, struct mmc_request *req);
+	void	(*post_req)(struct mmc_host *host, struct mmc_request *req,
+			    int err);
 	/*
 	 * Avoid calling these three functions too often or in a "fast path",
 	 * since underlaying controller might implement them in an expensive
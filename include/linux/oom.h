@@ -14,6 +14,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -34,6 +35,41 @@ extern int unregister_oom_notifier(struct notifier_block *nb);
 
 extern bool oom_killer_disabled;
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/*
+ * The lowmemorykiller keeps every thread group leader on a list per
+ * oom_adj value, so that it can find a victim without walking all tasks.
+ */
+extern void lowmem_adj_add(struct task_struct *task);
+extern void lowmem_adj_del(struct task_struct *task);
+extern void lowmem_adj_replace(struct task_struct *old,
+			       struct task_struct *new);
+extern void lowmem_adj_update(struct task_struct *task);
+extern void lowmem_vmpressure(unsigned long scanned, unsigned long reclaimed);
+#else
+static inline void lowmem_adj_add(struct task_struct *task)
+{
+}
+
+static inline void lowmem_adj_del(struct task_struct *task)
+{
+}
+
+static inline void lowmem_adj_replace(struct task_struct *old,
+				      struct task_struct *new)
+{
+}
+
+static inline void lowmem_adj_update(struct task_struct *task)
+{
+}
+
+static inline void lowmem_vmpressure(unsigned long scanned,
+				     unsigned long reclaimed)
+{
+}
+#endif
+
 static inline void oom_killer_disable(void)
 {
 	oom_killer_disabled = true;